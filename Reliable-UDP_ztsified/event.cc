@@ -32,14 +32,18 @@ GNU General Public License for more details.
 #include "config.h" /* generated by config & autoconf */
 #endif
 
+#include <atomic>
 #include <vector>
-#include <logging_lock.h>
+#include <histogram.h>
+#include <lock_profiler.h>
+#include <object_pool.h>
 
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/time.h>
-
+#include <time.h>
 #include "event.h"
 
 /*
@@ -47,238 +51,1651 @@ GNU General Public License for more details.
 */
 struct event_data {
     struct event_data *next; /* next in list */
+    struct event_data **pprev; /* link pointing to us (timer wheel slot or expired list) */
     int (*callback)(int, void*); /* callback function */
     enum {FILE_EVENT, TIME_EVENT} e_type; /* type of event */
     int fd; /* File descriptor */
     zts_timeval timeout; /* Timeout */
+    unsigned long expires; /* Timeout in wheel ticks (milliseconds) */
+    unsigned long period; /* Re-arm interval in ticks, 0 for one-shot timers */
+    unsigned long slack; /* Ticks the expiry may be delayed by to share a wheel slot */
+    bool expired; /* Timer has been moved to the expired list */
+    bool running; /* Timer callback is being executed */
+    int slot; /* Index in the poll set (FILE_EVENT) */
+    bool deleted; /* Deregistered, leaves the poll set before the next poll / cancelled while running */
+    struct event_loop *loop; /* Loop the event is registered with */
     void *callback_arg; /* function argument */
-    char id[32]; /* string for identification/debugging */
+    const char *id; /* static string for identification/debugging */
+};
+
+/*
+* Hierarchical timer wheel (as in the BSD callout wheel / Linux timer_list).
+* One tick is one millisecond. tv1 holds the timers expiring within the next
+* TVR_SIZE ticks, one slot per tick. The TV_LEVELS levels above it hold timers
+* further away with coarser granularity; their slots are cascaded into the
+* lower levels when the wheel reaches them. Insertion and removal are O(1),
+* expiry is O(1) per timer plus the amortised cascade.
+*/
+#define TVN_BITS 6
+#define TVR_BITS 8
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TV_LEVELS 4
+#define MAX_TVAL ((1UL << (TVR_BITS + TV_LEVELS * TVN_BITS)) - 1)
+#define TV_SHIFT(level) (TVR_BITS + (level) * TVN_BITS)
+
+#define EVENT_SLAB_RECORDS 64 /* event_data records per slab allocation */
+#define EVENT_POST_SLAB 64 /* post_data records per slab of the post pool */
+#define EVENT_MAX_POLL_MS 3600000 /* Longest single poll, keeps the timeout within an int */
+#define EVENT_FALLBACK_POLL_MS 50 /* Poll interval when the wakeup channel is unavailable */
+
+struct timer_wheel {
+    unsigned long base; /* next tick to be processed */
+    unsigned long pending; /* timers in the wheel, not counting expired ones */
+    event_data *tv1[TVR_SIZE];
+    event_data *tvn[TV_LEVELS][TVN_SIZE];
+    event_data *expired; /* due timers waiting to be dispatched, in expiry order */
+    event_data **expired_tail;
+};
+
+/*
+* Event records are carved out of slabs that are kept until the loop is freed.
+* Released records go onto a per-loop free list, so once a loop has seen its
+* peak number of timers and descriptors, registering events costs no malloc.
+*/
+struct event_slab {
+    struct event_slab *next;
+    event_data records[EVENT_SLAB_RECORDS];
+};
+
+struct record_pool {
+    event_slab *slabs;
+    event_data *free_records; /* linked through next */
+    unsigned long long slab_mallocs;
+    unsigned long long records_allocated; /* handed out since the loop was created */
+    unsigned long records_in_use;
+    unsigned long records_in_use_max;
+};
+
+/*
+* Callback posted to a loop by event_post(). The posts form Vyukov's
+* intrusive MPSC queue: producers only exchange the head, the loop pops from
+* the tail, and a stub node keeps the queue from ever becoming empty.
+*/
+struct post_data {
+    std::atomic<post_data *> next;
+    int (*callback)(int, void*);
+    void *callback_arg;
+};
+
+/*
+* Callback deferred to the end of the loop iteration by event_defer(). A
+* NULL callback marks an entry removed by event_defer_delete().
+*/
+struct defer_data {
+    int (*callback)(int, void*);
+    void *callback_arg;
 };
 
 /*
-* Internal variables
+* Latency statistics of a loop, all in nanoseconds. Only the loop thread
+* records; event_loop_latency() may read them from any thread.
+*/
+#define EVENT_STATS_IDS 32 /* Distinct callback ids with their own histogram */
+
+struct callback_stats {
+    const char *id;
+    Log2Histogram time;
+};
+
+struct loop_stats {
+    Log2Histogram iteration; /* from the end of a poll until its events are dispatched */
+    Log2Histogram poll_wait; /* time blocked in the transport's poll */
+    Log2Histogram timer_lateness; /* callback start minus the requested timeout */
+    callback_stats callbacks[EVENT_STATS_IDS];
+    std::atomic<int> callback_ids; /* used entries of callbacks, appended by the loop thread */
+};
+
+/*
+* An event loop. Loops share nothing, each one is driven by a single thread
+* and the handler mutexes only guard against registrations from other threads.
+*/
+struct event_loop {
+    std::mutex fd_handlers_mut;
+    /*
+    * The poll set, kept up to date by event_fd() and event_fd_delete().
+    * pollfd_handlers[i] is the handler of pollfds[i] (NULL for the wakeup
+    * channel). Only the eventloop touches the two vectors since it polls on
+    * them without holding a lock. Registrations and removals are queued and
+    * applied before the next poll.
+    */
+    std::vector<zts_pollfd> pollfds;
+    std::vector<event_data *> pollfd_handlers;
+    event_data *fd_added; /* registered, not in the poll set yet */
+    event_data *fd_removed; /* deregistered, still in the poll set */
+    int fd_handler_count; /* registered and not deregistered */
+    std::mutex timeout_handlers_mut;
+    timer_wheel timers;
+    record_pool records; /* guarded by timeout_handlers_mut */
+    unsigned long timer_slack; /* slack of timers registered without one, guarded by timeout_handlers_mut */
+    /*
+    * Set while the eventloop is blocked in its poll. Both are only written
+    * with both handler mutexes held, so reading them under either one is
+    * consistent.
+    */
+    bool polling;
+    unsigned long poll_deadline; /* tick the poll returns at */
+    /*
+    * Datagram transport the loop polls, see event_loop_set_transport().
+    */
+    const transport_t *transport;
+    std::atomic<bool> running; /* loop_run() is executing */
+    /*
+    * Wakeup channel.
+    * A socket of the loop's transport bound to the loopback address that
+    * sends to itself. It is part of every poll, so other threads can
+    * interrupt the wait with event_wakeup().
+    */
+    std::atomic<int> wakeup_fd;
+    zts_sockaddr_in6 wakeup_addr;
+    std::atomic<bool> wakeup_pending;
+    bool wakeup_polled; /* the wakeup channel has its slot in the poll set */
+    std::atomic<post_data *> post_head; /* last posted callback, written by producers */
+    post_data *post_tail; /* next posted callback to run, loop thread only */
+    post_data post_stub;
+    std::vector<defer_data> deferred; /* run at the end of the iteration, loop thread only */
+    loop_stats stats;
+    std::atomic<bool> stop_requested; /* set by eventloop_stop() */
+    /*
+    * Time source, the wall clock when NULL. Timer deadlines are timestamps
+    * of this clock. Only changed while the loop has no timers.
+    */
+    void (*clock)(zts_timeval *, void *);
+    void *clock_arg;
+    std::atomic<unsigned long long> virtual_us; /* time of the simulation clock, see event_loop_simulate() */
+};
+
+/*
+* Internal variables
+*/
+
+/* Contention statistics of the handler mutexes, summed over all loops */
+static LockStats fd_handlers_stats("fd_handlers_mut");
+static LockStats timeout_handlers_stats("timeout_handlers_mut");
+
+/*
+* Posted callbacks of all loops. Posts are usually released by another
+* thread than the one that allocated them, so they share one pool.
+*/
+static ObjectPool post_pool("post_data", sizeof(struct post_data), EVENT_POST_SLAB);
+
+/* Loop run by the calling thread, if any */
+static thread_local event_loop *current_loop = NULL;
+
+/*
+* Timer wheel helpers. All of them expect the loop's timeout_handlers_mut to
+* be held.
+*/
+static unsigned long
+timeval_to_tick(const zts_timeval *t)
+{
+    /* Round up, a timer must never fire before its timeout */
+    return (unsigned long)t->tv_sec * 1000UL + ((unsigned long)t->tv_usec + 999UL) / 1000UL;
+}
+
+/*
+* Expiry tick of a timer due at <tick> with <slack> ticks of slack: the next
+* multiple of the slack, so timers due within the same slack interval share
+* one wheel slot and fire in one batch. Never earlier than <tick>.
+*/
+static unsigned long
+timer_expiry(unsigned long tick, unsigned long slack)
+{
+    if (slack <= 1)
+        return tick;
+    return tick + (slack - tick % slack) % slack;
+}
+
+static unsigned long
+current_tick(event_loop *loop)
+{
+    zts_timeval now;
+
+    event_loop_time(loop, &now);
+    return (unsigned long)now.tv_sec * 1000UL + (unsigned long)now.tv_usec / 1000UL;
+}
+
+/*
+* Clock of a simulated loop: it only moves when the loop runs out of work.
+*/
+static void
+virtual_clock(zts_timeval *now, void *arg)
+{
+    unsigned long long us = ((event_loop *)arg)->virtual_us.load(std::memory_order_acquire);
+
+    now->tv_sec = us / 1000000ULL;
+    now->tv_usec = us % 1000000ULL;
+}
+
+static bool
+loop_simulated(event_loop *loop)
+{
+    return loop->clock == virtual_clock;
+}
+
+static unsigned long long
+monotonic_ns()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+* Histogram of the callback registered as <id>, created on first use.
+* NULL once EVENT_STATS_IDS ids are in use. Loop thread only.
+*/
+static Log2Histogram *
+callback_stats_find(loop_stats *stats, const char *id)
+{
+    int i, n = stats->callback_ids.load(std::memory_order_relaxed);
+
+    /* Ids are static strings, so the same literal usually hits the first test */
+    for (i = 0; i < n; i++)
+    {
+        if (stats->callbacks[i].id == id)
+            return &stats->callbacks[i].time;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (strcmp(stats->callbacks[i].id, id) == 0)
+            return &stats->callbacks[i].time;
+    }
+    if (n == EVENT_STATS_IDS)
+        return NULL;
+    stats->callbacks[n].id = id;
+    stats->callback_ids.store(n + 1, std::memory_order_release);
+    return &stats->callbacks[n].time;
+}
+
+/*
+* Run a callback and account its execution time to <id>. <clock> holds the
+* time the callback starts at and is advanced to the time it returned, so a
+* batch of callbacks reads the clock once per callback.
+*/
+static int
+callback_run(event_loop *loop, const char *id, int (*fn)(int, void*), int fd, void *arg, unsigned long long *clock)
+{
+    unsigned long long start = *clock;
+    Log2Histogram *time;
+    int result;
+
+    result = (*fn)(fd, arg);
+    *clock = monotonic_ns();
+    time = callback_stats_find(&loop->stats, id);
+    if (time)
+        time->record(*clock - start);
+    return result;
+}
+
+/*
+* Is the eventloop blocked in a poll that returns only after <tick>?
+*/
+static bool
+poll_sleeps_past(event_loop *loop, unsigned long tick)
+{
+    return loop->polling && (loop->poll_deadline == ULONG_MAX || (long)(tick - loop->poll_deadline) < 0);
+}
+
+static bool
+timers_empty(timer_wheel *wheel)
+{
+    return wheel->pending == 0 && wheel->expired == NULL;
+}
+
+static void
+timer_link(event_data **slot, event_data *e)
+{
+    e->next = *slot;
+    if (e->next)
+        e->next->pprev = &e->next;
+    e->pprev = slot;
+    *slot = e;
+}
+
+static void
+timer_unlink(timer_wheel *wheel, event_data *e)
+{
+    *e->pprev = e->next;
+    if (e->next)
+        e->next->pprev = e->pprev;
+    else if (wheel->expired_tail == &e->next)
+        wheel->expired_tail = e->pprev;
+    if (!e->expired)
+        wheel->pending--;
+    e->next = NULL;
+    e->pprev = NULL;
+    e->expired = false;
+}
+
+static void
+wheel_add(timer_wheel *wheel, event_data *e)
+{
+    unsigned long expires = e->expires;
+    unsigned long idx = expires - wheel->base;
+    event_data **slot;
+    int level;
+
+    if ((long)idx < 0)
+    {
+        /* Already due, process it with the next tick */
+        slot = &wheel->tv1[wheel->base & TVR_MASK];
+    }
+    else if (idx < TVR_SIZE)
+    {
+        slot = &wheel->tv1[expires & TVR_MASK];
+    }
+    else
+    {
+        if (idx > MAX_TVAL)
+        {
+            /* Beyond the wheel's range: park it in the farthest slot, it is re-sorted on cascade */
+            expires = wheel->base + MAX_TVAL;
+            idx = MAX_TVAL;
+        }
+        for (level = 0; level < TV_LEVELS - 1; level++)
+        {
+            if (idx < 1UL << TV_SHIFT(level + 1))
+                break;
+        }
+        slot = &wheel->tvn[level][(expires >> TV_SHIFT(level)) & TVN_MASK];
+    }
+    timer_link(slot, e);
+    wheel->pending++;
+}
+
+/*
+* Re-sort the timers of one slot of level <level> into the lower levels.
+* Returns the slot index, the caller cascades the next level when it is 0.
+*/
+static int
+wheel_cascade(timer_wheel *wheel, int level)
+{
+    int index = (wheel->base >> TV_SHIFT(level)) & TVN_MASK;
+    event_data *iterator, *next;
+
+    iterator = wheel->tvn[level][index];
+    wheel->tvn[level][index] = NULL;
+    for (; iterator; iterator = next)
+    {
+        next = iterator->next;
+        wheel->pending--;
+        wheel_add(wheel, iterator);
+    }
+    return index;
+}
+
+/*
+* Advance the wheel up to tick <now> and append every due timer to the
+* expired list.
+*/
+static void
+wheel_run(timer_wheel *wheel, unsigned long now)
+{
+    event_data *iterator, *next;
+    int index, level;
+
+    while ((long)(now - wheel->base) >= 0)
+    {
+        if (wheel->pending == 0)
+        {
+            wheel->base = now + 1;
+            break;
+        }
+        index = wheel->base & TVR_MASK;
+        if (index == 0)
+        {
+            for (level = 0; level < TV_LEVELS; level++)
+            {
+                if (wheel_cascade(wheel, level) != 0)
+                    break;
+            }
+        }
+        wheel->base++;
+        iterator = wheel->tv1[index];
+        wheel->tv1[index] = NULL;
+        for (; iterator; iterator = next)
+        {
+            next = iterator->next;
+            wheel->pending--;
+            iterator->expired = true;
+            iterator->next = NULL;
+            iterator->pprev = wheel->expired_tail;
+            *wheel->expired_tail = iterator;
+            wheel->expired_tail = &iterator->next;
+        }
+    }
+}
+
+/*
+* Earliest tick at which the wheel needs attention: the expiry of the first
+* timer in tv1 or the point where a non-empty higher level slot gets cascaded,
+* whichever comes first.
+*/
+static unsigned long
+wheel_next_tick(timer_wheel *wheel)
+{
+    unsigned long next = wheel->base + MAX_TVAL;
+    int i, level;
+
+    /* base is the first tick not run yet, expired timers were due before it */
+    if (wheel->expired)
+        return wheel->base - 1;
+    for (i = 0; i < TVR_SIZE; i++)
+    {
+        if (wheel->tv1[(wheel->base + i) & TVR_MASK])
+        {
+            next = wheel->base + i;
+            break;
+        }
+    }
+    for (level = 0; level < TV_LEVELS; level++)
+    {
+        unsigned long slot = wheel->base >> TV_SHIFT(level);
+        /* On a slot boundary the current slot has not been cascaded yet */
+        int first = (wheel->base & ((1UL << TV_SHIFT(level)) - 1)) ? 1 : 0;
+
+        for (i = first; i < first + TVN_SIZE; i++)
+        {
+            if (wheel->tvn[level][(slot + i) & TVN_MASK])
+            {
+                unsigned long cascade_at = (slot + i) << TV_SHIFT(level);
+
+                if ((long)(cascade_at - next) < 0)
+                    next = cascade_at;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+static void
+post_push(event_loop *loop, post_data *post)
+{
+    post_data *prev;
+
+    post->next.store(NULL, std::memory_order_relaxed);
+    prev = loop->post_head.exchange(post, std::memory_order_acq_rel);
+    /* Until this store the consumer sees the queue end at prev */
+    prev->next.store(post, std::memory_order_release);
+}
+
+/*
+* Take the oldest posted callback off the queue. Returns NULL when it is
+* empty, or when the next post is still being linked in by its producer.
+* Loop thread only.
+*/
+static post_data *
+post_pop(event_loop *loop)
+{
+    post_data *tail = loop->post_tail;
+    post_data *next = tail->next.load(std::memory_order_acquire);
+
+    if (tail == &loop->post_stub)
+    {
+        if (next == NULL)
+            return NULL;
+        loop->post_tail = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next)
+    {
+        loop->post_tail = next;
+        return tail;
+    }
+    if (tail != loop->post_head.load(std::memory_order_acquire))
+        return NULL;
+    /* tail is the last post, put the stub behind it so it can be taken */
+    post_push(loop, &loop->post_stub);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next)
+    {
+        loop->post_tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static bool
+post_pending(event_loop *loop)
+{
+    return loop->post_tail != &loop->post_stub ||
+        loop->post_head.load(std::memory_order_acquire) != &loop->post_stub;
+}
+
+/*
+* Take a zeroed event record from the pool of <loop>, allocating a new slab
+* only when the free list is empty. Expects timeout_handlers_mut to be held.
+*/
+static event_data *
+record_alloc(event_loop *loop)
+{
+    record_pool *pool = &loop->records;
+    event_data *record;
+    event_slab *slab;
+    int i;
+
+    if (pool->free_records == NULL)
+    {
+        slab = (struct event_slab *)malloc(sizeof(struct event_slab));
+        if (slab == NULL)
+            return NULL;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->slab_mallocs++;
+        for (i = EVENT_SLAB_RECORDS - 1; i >= 0; i--)
+        {
+            slab->records[i].next = pool->free_records;
+            pool->free_records = &slab->records[i];
+        }
+    }
+    record = pool->free_records;
+    pool->free_records = record->next;
+    memset(record, 0, sizeof(event_data));
+    pool->records_allocated++;
+    if (++pool->records_in_use > pool->records_in_use_max)
+        pool->records_in_use_max = pool->records_in_use;
+    return record;
+}
+
+/*
+* Return a record to the pool of its loop. Expects timeout_handlers_mut to be
+* held.
+*/
+static void
+record_free(event_data *record)
+{
+    record_pool *pool = &record->loop->records;
+
+    record->next = pool->free_records;
+    pool->free_records = record;
+    pool->records_in_use--;
+}
+
+/*
+* Create an event loop with no events registered.
+*/
+event_loop_t *
+event_loop_new()
+{
+    struct event_loop *loop;
+
+    loop = new (std::nothrow) event_loop;
+    if (loop == NULL)
+    {
+        perror("event_loop_new: new");
+        return NULL;
+    }
+    loop->fd_added = NULL;
+    loop->fd_removed = NULL;
+    loop->fd_handler_count = 0;
+    memset(&loop->timers, 0, sizeof(loop->timers));
+    loop->timers.expired_tail = &loop->timers.expired;
+    memset(&loop->records, 0, sizeof(loop->records));
+    loop->timer_slack = 0;
+    loop->polling = false;
+    loop->poll_deadline = ULONG_MAX;
+    loop->transport = &transport_zts;
+    loop->running = false;
+    loop->wakeup_fd = -1;
+    memset(&loop->wakeup_addr, 0, sizeof(loop->wakeup_addr));
+    loop->wakeup_pending = false;
+    loop->wakeup_polled = false;
+    loop->stop_requested = false;
+    loop->post_stub.next = NULL;
+    loop->post_head = &loop->post_stub;
+    loop->post_tail = &loop->post_stub;
+    loop->stats.callback_ids = 0;
+    loop->clock = NULL;
+    loop->clock_arg = NULL;
+    loop->virtual_us = 0;
+    return loop;
+}
+
+/*
+* Release a loop that is not running, along with the events still registered
+* with it. The callback arguments are left to their owners.
+*/
+void
+event_loop_free(event_loop_t *loop)
+{
+    struct event_slab *slab, *next;
+    struct post_data *post;
+
+    if (loop == NULL)
+        return;
+    /* Posted callbacks that never ran are dropped */
+    while ((post = post_pop(loop)) != NULL)
+        post_pool.destroy(post);
+    /* Every event record lives in one of the slabs */
+    for (slab = loop->records.slabs; slab; slab = next)
+    {
+        next = slab->next;
+        free(slab);
+    }
+    if (loop->wakeup_fd >= 0)
+        loop->transport->close(loop->wakeup_fd);
+    delete loop;
+}
+
+/*
+* The loop used by callers that do not run loops of their own.
+*/
+event_loop_t *
+event_loop_default()
+{
+    static event_loop *default_loop = event_loop_new();
+
+    return default_loop;
+}
+
+/*
+* The current time of <loop>'s clock. Timer deadlines are timestamps of this
+* clock, so callers computing one (e.g. now + a retransmission timeout) should
+* read it here rather than from gettimeofday().
+*/
+void
+event_loop_time(event_loop_t *loop, zts_timeval *now)
+{
+    struct timeval wall;
+
+    if (loop->clock)
+    {
+        loop->clock(now, loop->clock_arg);
+        return;
+    }
+    gettimeofday(&wall, NULL);
+    now->tv_sec = wall.tv_sec;
+    now->tv_usec = wall.tv_usec;
+}
+
+/*
+* Replace the wall clock of <loop> by <clock>, which stores the current time
+* in its first argument and is called with <arg>. NULL restores the wall
+* clock. The clock must never go backwards. The loop keeps sleeping in real
+* time, so a custom clock should advance at about the rate of the wall clock.
+* Only allowed while no timers are registered with the loop.
+*/
+int
+event_loop_set_clock(event_loop_t *loop, void (*clock)(zts_timeval *now, void *arg), void *arg)
+{
+    ProfiledLock timeout_handlers_ll(loop->timeout_handlers_mut, timeout_handlers_stats);
+    if (!timers_empty(&loop->timers))
+    {
+        fprintf(stderr, "event_loop_set_clock: timers are registered\n");
+        return -1;
+    }
+    loop->clock = clock;
+    loop->clock_arg = arg;
+    return 0;
+}
+
+/*
+* Put <loop> into simulation mode: its clock becomes a virtual one starting
+* at <start>, and it never sleeps. Whenever a poll finds no input and nothing
+* is posted, the clock jumps straight to the next timer (or the deadline of
+* eventloop_run_once() and eventloop_run_until()). Timer callbacks thus see
+* the same time and order on every run, however long the simulated timeouts.
+* Input that arrives over a real network may be seen before or after such a
+* jump, so deterministic runs need a transport that delivers in-process.
+* Only allowed while no timers are registered with the loop.
+*/
+int
+event_loop_simulate(event_loop_t *loop, zts_timeval start)
+{
+    ProfiledLock timeout_handlers_ll(loop->timeout_handlers_mut, timeout_handlers_stats);
+    if (!timers_empty(&loop->timers))
+    {
+        fprintf(stderr, "event_loop_simulate: timers are registered\n");
+        return -1;
+    }
+    loop->virtual_us = (unsigned long long)start.tv_sec * 1000000ULL + start.tv_usec;
+    loop->clock = virtual_clock;
+    loop->clock_arg = loop;
+    return 0;
+}
+
+/*
+* Make <loop> poll and wake up through <transport> instead of libzt. The
+* descriptors registered with the loop have to be handles of the same
+* transport. Only allowed while the loop is not running and has no
+* descriptors registered.
+*/
+int
+event_loop_set_transport(event_loop_t *loop, const transport_t *transport)
+{
+    ProfiledLock timeout_handlers_ll(loop->timeout_handlers_mut, timeout_handlers_stats), fd_handlers_ll(loop->fd_handlers_mut, fd_handlers_stats);
+    if (loop->running || loop->fd_handler_count > 0 || loop->fd_removed)
+    {
+        fprintf(stderr, "event_loop_set_transport: loop is running or has descriptors\n");
+        return -1;
+    }
+    /* Only the wakeup channel can be left in the poll set, it is reopened on the next run */
+    if (loop->wakeup_fd >= 0)
+    {
+        loop->transport->close(loop->wakeup_fd);
+        loop->wakeup_fd = -1;
+    }
+    loop->pollfds.clear();
+    loop->pollfd_handlers.clear();
+    loop->wakeup_polled = false;
+    loop->transport = transport;
+    return 0;
+}
+
+static zts_timeval
+tick_to_timeval(unsigned long tick)
+{
+    zts_timeval t;
+
+    t.tv_sec = tick / 1000;
+    t.tv_usec = (tick % 1000) * 1000;
+    return t;
+}
+
+/*
+* Allocate a timer due at <t> and add it to the wheel of <loop>. A negative
+* <slack> takes the loop's timer slack.
+*/
+static event_data *
+timer_add(event_loop *loop, zts_timeval t, long slack, unsigned long period, int (*fn)(int, void*), void *callback_arg, const char *id)
+{
+    struct event_data *new_event_handler;
+
+    ProfiledLock timeout_handlers_ll(loop->timeout_handlers_mut, timeout_handlers_stats);
+    new_event_handler = record_alloc(loop);
+    if (new_event_handler == NULL)
+    {
+        perror("event_timeout: malloc");
+        return NULL;
+    }
+    new_event_handler->id = id;
+    new_event_handler->callback = fn;
+    new_event_handler->callback_arg = callback_arg;
+    new_event_handler->e_type = event_data::TIME_EVENT;
+    new_event_handler->timeout = t;
+    new_event_handler->slack = slack < 0 ? loop->timer_slack : slack;
+    new_event_handler->expires = timer_expiry(timeval_to_tick(&t), new_event_handler->slack);
+    new_event_handler->period = period;
+    new_event_handler->loop = loop;
+    if (timers_empty(&loop->timers))
+        loop->timers.base = current_tick(loop);
+    wheel_add(&loop->timers, new_event_handler);
+    if (poll_sleeps_past(loop, new_event_handler->expires))
+        event_wakeup(loop);
+    return new_event_handler;
+}
+
+/*
+* Register a function to be called at the absolute timestamp <t>, delayed by
+* at most the loop's timer slack.
+* Returns a handle that stays valid until the timer has fired or is cancelled.
+*/
+event_timer_t
+event_timeout(event_loop_t *loop, zts_timeval t, int (*fn)(int, void*), void *callback_arg, const char *id)
+{
+    return timer_add(loop, t, -1, 0, fn, callback_arg, id);
+}
+
+/*
+* Like event_timeout(), with its own slack: the callback runs up to
+* <slack_ms> - 1 milliseconds after <t>, together with the other timers that
+* fall into the same slack interval. The slack also applies when the timer
+* is rescheduled.
+*/
+event_timer_t
+event_timeout_slack(event_loop_t *loop, zts_timeval t, int slack_ms, int (*fn)(int, void*), void *callback_arg, const char *id)
+{
+    if (slack_ms < 0)
+    {
+        fprintf(stderr, "event_timeout_slack: invalid slack %d\n", slack_ms);
+        return NULL;
+    }
+    return timer_add(loop, t, slack_ms, 0, fn, callback_arg, id);
+}
+
+/*
+* Set the slack of the timers registered with event_timeout() on <loop> from
+* now on. Rounding their deadlines up to multiples of <slack_ms> makes timers
+* armed close to each other expire on the same tick, so the loop wakes up
+* once per slack interval instead of once per timer. 0 (the default) fires
+* every timer on its own tick.
+*/
+int
+event_loop_set_timer_slack(event_loop_t *loop, int slack_ms)
+{
+    if (slack_ms < 0)
+    {
+        fprintf(stderr, "event_loop_set_timer_slack: invalid slack %d\n", slack_ms);
+        return -1;
+    }
+
+    ProfiledLock timeout_handlers_ll(loop->timeout_handlers_mut, timeout_handlers_stats);
+    loop->timer_slack = slack_ms;
+    return 0;
+}
+
+/*
+* Register a function to be called every <interval_ms> milliseconds, the
+* first time one interval from now. The timer is re-armed in place after each
+* call, so it costs no allocation per period; periods missed entirely (e.g.
+* because a callback blocked the loop) are skipped rather than fired late in
+* a burst. Periodic timers keep their phase and take no slack. It keeps the
+* loop alive until cancelled with event_timer_cancel().
+*/
+event_timer_t
+event_periodic(event_loop_t *loop, int interval_ms, int (*fn)(int, void*), void *callback_arg, const char *id)
+{
+    if (interval_ms <= 0)
+    {
+        fprintf(stderr, "event_periodic: invalid interval %d\n", interval_ms);
+        return NULL;
+    }
+    return timer_add(loop, tick_to_timeval(current_tick(loop) + interval_ms), 0, interval_ms, fn, callback_arg, id);
+}
+
+/*
+* Cancel a pending timer. A timer may cancel itself from its own callback.
+*/
+int
+event_timer_cancel(event_timer_t timer)
+{
+    if (timer == NULL)
+        return -1;
+
+    ProfiledLock timeout_handlers_ll(timer->loop->timeout_handlers_mut, timeout_handlers_stats);
+    if (timer->pprev)
+        timer_unlink(&timer->loop->timers, timer);
+    /* A running timer is released by the eventloop once its callback returns */
+    if (timer->running)
+        timer->deleted = true;
+    else
+        record_free(timer);
+    return 0;
+}
+
+/*
+* Move a timer to the absolute timestamp <t>. Called from the timer's own
+* callback this re-arms it in place, otherwise the handle would be released
+* when the callback returns.
+*/
+int
+event_timer_reschedule(event_timer_t timer, zts_timeval t)
+{
+    struct event_loop *loop;
+
+    if (timer == NULL)
+        return -1;
+
+    loop = timer->loop;
+    ProfiledLock timeout_handlers_ll(loop->timeout_handlers_mut, timeout_handlers_stats);
+    if (timer->pprev)
+        timer_unlink(&loop->timers, timer);
+    timer->timeout = t;
+    timer->expires = timer_expiry(timeval_to_tick(&t), timer->slack);
+    if (timers_empty(&loop->timers))
+        loop->timers.base = current_tick(loop);
+    wheel_add(&loop->timers, timer);
+    if (poll_sleeps_past(loop, timer->expires))
+        event_wakeup(loop);
+    return 0;
+}
+
+/*
+* The callback argument a timer was registered with.
 */
-
-#define GET_VARIABLE_NAME(x) std::string(#x)
-
-std::mutex fd_handlers_mut;
-static event_data *fd_event_handlers = NULL;
-std::mutex timeout_handlers_mut;
-static event_data *timeout_event_handlers = NULL;
+void *
+event_timer_arg(event_timer_t timer)
+{
+    return timer ? timer->callback_arg : NULL;
+}
 
 /*
-* Sort into internal event list
-* Given an absolute timestamp, register function to call.
+* Find the timer registered with (<fn>, <arg>) in one wheel slot.
 */
-int
-event_timeout(zts_timeval t, int (*fn)(int, void*), void *callback_arg, const char *id)
+static event_data *
+timer_find(event_data *slot, int (*fn)(int, void*), void *arg)
 {
-    struct event_data *new_event_handler, *iterator, **list_head_addr;
+    struct event_data *iterator;
 
-    new_event_handler = (struct event_data *)malloc(sizeof(struct event_data));
-    if (new_event_handler == NULL)
+    for (iterator = slot; iterator; iterator = iterator->next)
     {
-        perror("event_timeout: malloc");
-        return -1;
+        if (fn == iterator->callback && arg == iterator->callback_arg)
+            return iterator;
     }
-    memset(new_event_handler, 0, sizeof(event_data));
-    strcpy(new_event_handler->id, id);
-    new_event_handler->callback = fn;
-    new_event_handler->callback_arg = callback_arg;
-    new_event_handler->e_type = event_data::TIME_EVENT;
-    new_event_handler->timeout = t;
+    return NULL;
+}
+
+/*
+* Deregister a rudp event.
+* This searches the whole wheel, prefer event_timer_cancel() on the handle.
+*/
+int event_timeout_delete(event_loop_t *loop, int (*fn)(int, void*), void *arg)
+{
+    struct event_data *found;
+    timer_wheel *wheel = &loop->timers;
+    int i, level;
 
-    /* Sort into right place */
-    LoggingLock timeout_handlers_ll(timeout_handlers_mut, GET_VARIABLE_NAME(timeout_handlers_mut), "./log");
-    list_head_addr = &timeout_event_handlers;
-    for (iterator = timeout_event_handlers; iterator; iterator = iterator->next)
+    ProfiledLock timeout_handlers_ll(loop->timeout_handlers_mut, timeout_handlers_stats);
+    found = timer_find(wheel->expired, fn, arg);
+    for (i = 0; !found && i < TVR_SIZE; i++)
+        found = timer_find(wheel->tv1[i], fn, arg);
+    for (level = 0; !found && level < TV_LEVELS; level++)
     {
-        if (timercmp(&new_event_handler->timeout, &iterator->timeout, <))
-            break;
-        list_head_addr = &iterator->next;
+        for (i = 0; !found && i < TVN_SIZE; i++)
+            found = timer_find(wheel->tvn[level][i], fn, arg);
     }
-    new_event_handler->next = iterator;
-    *list_head_addr = new_event_handler;
+    if (found == NULL)
+        return -1;
+    timer_unlink(wheel, found);
+    if (found->running)
+        found->deleted = true;
+    else
+        record_free(found);
     return 0;
 }
 
 /*
-* Deregister a rudp event.
+* Deregister a file descriptor event.
 */
-static int
-event_delete(event_data **firstp, int (*fn)(int, void*), void *arg)
+int event_fd_delete(event_loop_t *loop, int (*fn)(int, void*), void *arg)
 {
     struct event_data *iterator, **e_prev;
 
-    e_prev = firstp;
-    for (iterator = *firstp; iterator; iterator = iterator->next)
+    /* The record pool is guarded by the timeout lock, taken first as in the eventloop */
+    ProfiledLock timeout_handlers_ll(loop->timeout_handlers_mut, timeout_handlers_stats), fd_handlers_ll(loop->fd_handlers_mut, fd_handlers_stats);
+    /* Not polled yet, so it can go right away */
+    for (e_prev = &loop->fd_added; (iterator = *e_prev); e_prev = &iterator->next)
     {
         if (fn == iterator->callback && arg == iterator->callback_arg)
         {
             *e_prev = iterator->next;
-            free(iterator);
+            record_free(iterator);
+            loop->fd_handler_count--;
+            return 0;
+        }
+    }
+    for (auto handler : loop->pollfd_handlers)
+    {
+        if (handler && !handler->deleted && fn == handler->callback && arg == handler->callback_arg)
+        {
+            handler->deleted = true;
+            handler->next = loop->fd_removed;
+            loop->fd_removed = handler;
+            loop->fd_handler_count--;
+            /* Let a blocked poll drop the descriptor (and the loop end if it was the last one) */
+            if (loop->polling)
+                event_wakeup(loop);
             return 0;
         }
-        e_prev = &iterator->next;
     }
     /* Not found */
     return -1;
 }
 
-/*
-* Deregister a rudp event.
-*/
-int event_timeout_delete(int (*fn)(int, void*), void *arg)
-{
-    LoggingLock timeout_handlers_ll(timeout_handlers_mut, GET_VARIABLE_NAME(timeout_handlers_mut), "./log");
-    return event_delete(&timeout_event_handlers, fn, arg);
-}
-
-/*
-* Deregister a file descriptor event.
-*/
-int event_fd_delete(int (*fn)(int, void*), void *arg)
-{
-    LoggingLock fd_handlers_ll(fd_handlers_mut, GET_VARIABLE_NAME(fd_handlers_mut), "./log");
-    return event_delete(&fd_event_handlers, fn, arg);
-}
-
 /*
 * Register a callback function when something occurs on a file descriptor.
 * When an input event occurs on file desriptor <fd>,
 * the function <fn> shall be called with argument <arg>.
 * <str> is a debug string for logging.
 */
-int event_fd(int fd, int (*fn)(int, void*), void *callback_arg, const char *id)
+int event_fd(event_loop_t *loop, int fd, int (*fn)(int, void*), void *callback_arg, const char *id)
 {
     struct event_data *new_event_handler;
 
-    new_event_handler = (struct event_data *)malloc(sizeof(struct event_data));
+    ProfiledLock timeout_handlers_ll(loop->timeout_handlers_mut, timeout_handlers_stats);
+    new_event_handler = record_alloc(loop);
     if (new_event_handler==NULL)
     {
         perror("event_fd: malloc");
         return -1;
     }
-    memset(new_event_handler, 0, sizeof(struct event_data));
-    strcpy(new_event_handler->id, id);
+    new_event_handler->id = id;
     new_event_handler->fd = fd;
     new_event_handler->callback = fn;
     new_event_handler->callback_arg = callback_arg;
     new_event_handler->e_type = event_data::FILE_EVENT;
-    LoggingLock fd_handlers_lg(fd_handlers_mut, GET_VARIABLE_NAME(fd_handlers_mut), "./log");
-    new_event_handler->next = fd_event_handlers;
-    fd_event_handlers = new_event_handler;
+    new_event_handler->slot = -1;
+    new_event_handler->loop = loop;
+    ProfiledLock fd_handlers_lg(loop->fd_handlers_mut, fd_handlers_stats);
+    new_event_handler->next = loop->fd_added;
+    loop->fd_added = new_event_handler;
+    loop->fd_handler_count++;
+    /* The running poll does not know about the new descriptor yet */
+    if (loop->polling)
+        event_wakeup(loop);
+    return 0;
+}
+
+/*
+* Apply the queued registrations and removals to the poll set.
+* Removal moves the last slot into the freed one, so both are O(1).
+* Expects both handler mutexes to be held, called by the eventloop only.
+*/
+static void
+pollset_apply(event_loop *loop)
+{
+    struct event_data *iterator, *next;
+    zts_pollfd pollfd;
+    int slot;
+
+    for (iterator = loop->fd_removed; iterator; iterator = next)
+    {
+        next = iterator->next;
+        slot = iterator->slot;
+        loop->pollfds[slot] = loop->pollfds.back();
+        loop->pollfd_handlers[slot] = loop->pollfd_handlers.back();
+        if (loop->pollfd_handlers[slot])
+            loop->pollfd_handlers[slot]->slot = slot;
+        loop->pollfds.pop_back();
+        loop->pollfd_handlers.pop_back();
+        record_free(iterator);
+    }
+    loop->fd_removed = NULL;
+    for (iterator = loop->fd_added; iterator; iterator = next)
+    {
+        next = iterator->next;
+        pollfd.fd = iterator->fd;
+        pollfd.events = ZTS_POLLIN;
+        pollfd.revents = 0;
+        iterator->slot = loop->pollfds.size();
+        iterator->next = NULL;
+        loop->pollfds.push_back(pollfd);
+        loop->pollfd_handlers.push_back(iterator);
+    }
+    loop->fd_added = NULL;
+}
+
+static int
+wakeup_open(event_loop *loop)
+{
+    int fd;
+
+    if (loop->wakeup_fd >= 0)
+        return 0;
+    memset(&loop->wakeup_addr, 0, sizeof(loop->wakeup_addr));
+    loop->wakeup_addr.sin6_family = ZTS_AF_INET6;
+    if (zts_inet_pton(ZTS_AF_INET6, "::1", &loop->wakeup_addr.sin6_addr) <= 0)
+        return -1;
+    fd = loop->transport->open(&loop->wakeup_addr, true);
+    if (fd < 0)
+    {
+        fprintf(stderr, "wakeup_open: %s socket could not be opened\n", loop->transport->name);
+        return -1;
+    }
+    if (loop->transport->local_address(fd, &loop->wakeup_addr) < 0)
+    {
+        fprintf(stderr, "wakeup_open: %s socket has no address\n", loop->transport->name);
+        loop->transport->close(fd);
+        return -1;
+    }
+    loop->wakeup_fd = fd;
     return 0;
 }
 
+static void
+wakeup_drain(event_loop *loop)
+{
+    char buf[16];
+
+    loop->wakeup_pending = false;
+    while (loop->transport->recvfrom(loop->wakeup_fd, buf, sizeof(buf), NULL) > 0)
+        ;
+}
 
 /*
-* Rudp event loop.
-* Dispatch file descriptor events (and timeouts) by invoking callbacks.
+* Interrupt a blocking poll of the eventloop. Wakeups are coalesced: while
+* one is pending, further calls do not send anything.
 */
 int
-eventloop()
+event_wakeup(event_loop_t *loop)
 {
-    struct event_data *iterator;
-    std::vector<zts_pollfd> fds;
-    int n;
-    struct timeval time_diff, current_time;
+    char byte = 0;
+    int fd = loop->wakeup_fd;
+
+    if (fd < 0)
+        return -1;
+    if (loop->wakeup_pending.exchange(true))
+        return 0;
+    if (loop->transport->sendto(fd, &byte, 1, &loop->wakeup_addr) < 0)
+    {
+        loop->wakeup_pending = false;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+* Have <fn> called with <arg> on the thread running <loop>, in posting order.
+* Callable from any thread; neither the queue nor post_pool lock. The loop
+* is woken up if it sleeps.
+*/
+int
+event_post(event_loop_t *loop, int (*fn)(int, void*), void *callback_arg)
+{
+    struct post_data *post;
+
+    post = post_pool.create<struct post_data>();
+    if (post == NULL)
+    {
+        perror("event_post: malloc");
+        return -1;
+    }
+    post->callback = fn;
+    post->callback_arg = callback_arg;
+    post_push(loop, post);
+    event_wakeup(loop);
+    return 0;
+}
+
+/*
+* Have <fn> called with <arg> once the current iteration of <loop> has
+* dispatched its events, before the loop polls again. Lets callbacks collect
+* work across all events of an iteration, e.g. to send datagrams in one
+* batch. Only callable from callbacks running on <loop>.
+*/
+int
+event_defer(event_loop_t *loop, int (*fn)(int, void*), void *callback_arg)
+{
+    struct defer_data defer;
+
+    if (current_loop != loop)
+        return -1;
+    defer.callback = fn;
+    defer.callback_arg = callback_arg;
+    loop->deferred.push_back(defer);
+    return 0;
+}
+
+/*
+* Remove deferred callbacks that have not run yet, e.g. before <arg> is
+* freed. Only callable from callbacks running on <loop>.
+*/
+int
+event_defer_delete(event_loop_t *loop, int (*fn)(int, void*), void *callback_arg)
+{
+    if (current_loop != loop)
+        return -1;
+    for (auto &defer : loop->deferred)
+    {
+        if (defer.callback == fn && defer.callback_arg == callback_arg)
+            defer.callback = NULL;
+    }
+    return 0;
+}
+
+/*
+* Run the deferred callbacks in the order they were registered, including
+* those deferred meanwhile. Called without the handler locks held. Returns
+* the number of callbacks run, -1 if one failed.
+*/
+static int
+defer_run(event_loop *loop, unsigned long long *clock)
+{
+    struct defer_data defer;
+    int dispatched = 0;
 
-    LoggingLock timeout_handlers_ll(timeout_handlers_mut, GET_VARIABLE_NAME(timeout_handlers_mut), "./log"), fd_handlers_ll(fd_handlers_mut, GET_VARIABLE_NAME(fd_handlers_mut), "./log");
-    while (fd_event_handlers || timeout_event_handlers)
+    for (size_t i = 0; i < loop->deferred.size(); i++)
     {
-        fds.clear();
-        for (iterator=fd_event_handlers; iterator; iterator=iterator->next)
+        /* A copy, callbacks may grow the vector */
+        defer = loop->deferred[i];
+        if (defer.callback == NULL)
+            continue;
+        if (callback_run(loop, "event_defer", defer.callback, 0, defer.callback_arg, clock) < 0)
         {
-            if (iterator->e_type == event_data::FILE_EVENT)
+            loop->deferred.clear();
+            return -1;
+        }
+        dispatched++;
+    }
+    loop->deferred.clear();
+    return dispatched;
+}
+
+/*
+* The loop the calling thread is running, NULL outside of loop callbacks.
+*/
+event_loop_t *
+event_loop_current()
+{
+    return current_loop;
+}
+
+static void
+latency_fill(const Log2Histogram *histogram, struct event_latency *latency)
+{
+    latency->count = histogram->count();
+    latency->avg_ns = latency->count ? histogram->sum() / latency->count : 0;
+    latency->p50_ns = histogram->percentile(0.5);
+    latency->p99_ns = histogram->percentile(0.99);
+    latency->max_ns = histogram->max();
+}
+
+/*
+* Latency statistics of <loop> since it was created or last reset. For
+* EVENT_LATENCY_CALLBACK, <id> is the id string the callbacks were
+* registered with ("event_post" for posted callbacks). Percentiles are the
+* upper bounds of power of two buckets. Returns -1 for an unknown id.
+*/
+int
+event_loop_latency(event_loop_t *loop, event_latency_t which, const char *id, struct event_latency *latency)
+{
+    int i, n;
+
+    memset(latency, 0, sizeof(*latency));
+    switch (which)
+    {
+        case EVENT_LATENCY_ITERATION:
+            latency_fill(&loop->stats.iteration, latency);
+            return 0;
+        case EVENT_LATENCY_POLL_WAIT:
+            latency_fill(&loop->stats.poll_wait, latency);
+            return 0;
+        case EVENT_LATENCY_TIMER_LATENESS:
+            latency_fill(&loop->stats.timer_lateness, latency);
+            return 0;
+        case EVENT_LATENCY_CALLBACK:
+            n = loop->stats.callback_ids.load(std::memory_order_acquire);
+            for (i = 0; id && i < n; i++)
             {
-                // FD_SET(iterator->e_fd, &fdset);
-                zts_pollfd pollfd;
-                pollfd.fd = iterator->fd;
-                pollfd.events = 0;
-                pollfd.events |= ZTS_POLLIN;
-                fds.push_back(pollfd);
+                if (strcmp(loop->stats.callbacks[i].id, id) == 0)
+                {
+                    latency_fill(&loop->stats.callbacks[i].time, latency);
+                    return 0;
+                }
             }
+            return -1;
+    }
+    return -1;
+}
+
+static void
+latency_print(FILE *out, const char *name, const Log2Histogram *histogram)
+{
+    struct event_latency latency;
+
+    latency_fill(histogram, &latency);
+    fprintf(out, "%-24s n=%llu avg=%lluns p50=%lluns p99=%lluns max=%lluns\n", name,
+        latency.count, latency.avg_ns, latency.p50_ns, latency.p99_ns, latency.max_ns);
+}
+
+/*
+* Print every latency histogram of <loop>, one line each.
+*/
+void
+event_loop_latency_dump(event_loop_t *loop, FILE *out)
+{
+    int i, n;
+
+    latency_print(out, "iteration", &loop->stats.iteration);
+    latency_print(out, "poll_wait", &loop->stats.poll_wait);
+    latency_print(out, "timer_lateness", &loop->stats.timer_lateness);
+    n = loop->stats.callback_ids.load(std::memory_order_acquire);
+    for (i = 0; i < n; i++)
+        latency_print(out, loop->stats.callbacks[i].id, &loop->stats.callbacks[i].time);
+}
+
+/*
+* Zero the latency histograms of <loop>, e.g. after a warm-up phase. The ids
+* seen so far keep their entries.
+*/
+void
+event_loop_latency_reset(event_loop_t *loop)
+{
+    int i, n;
+
+    loop->stats.iteration.reset();
+    loop->stats.poll_wait.reset();
+    loop->stats.timer_lateness.reset();
+    n = loop->stats.callback_ids.load(std::memory_order_acquire);
+    for (i = 0; i < n; i++)
+        loop->stats.callbacks[i].time.reset();
+}
+
+/*
+* Allocator counters of <loop>. A slab_mallocs count that stays constant
+* while traffic flows means events are registered without touching the heap.
+*/
+void
+event_loop_alloc_stats(event_loop_t *loop, struct event_alloc_stats *stats)
+{
+    record_pool *pool = &loop->records;
+
+    ProfiledLock timeout_handlers_ll(loop->timeout_handlers_mut, timeout_handlers_stats);
+    stats->slab_mallocs = pool->slab_mallocs;
+    stats->records_allocated = pool->records_allocated;
+    stats->records_in_use = pool->records_in_use;
+    stats->records_in_use_max = pool->records_in_use_max;
+    stats->records_free = pool->slab_mallocs * EVENT_SLAB_RECORDS - pool->records_in_use;
+}
+
+/*
+* Make a running eventloop(), eventloop_run() or eventloop_run_until() on
+* <loop> return after the current iteration. May be called from any thread;
+* if the loop is not running, its next run returns right away.
+*/
+void
+eventloop_stop(event_loop_t *loop)
+{
+    loop->stop_requested = true;
+    event_wakeup(loop);
+}
+
+/*
+* Dispatch file descriptor events (and timeouts) by invoking callbacks.
+* The loop blocks in its transport's poll until input arrives, the next timer is due or
+* another thread calls event_wakeup(). A simulated loop only checks for input
+* and, if there is none, advances its clock to the next timer instead. Callbacks run without the handler locks
+* held, so they may register and cancel events themselves.
+* Returns when stopped, after one iteration if <once>, when the tick
+* <deadline> is reached (ULONG_MAX for none) or, unless <until_stopped>, when
+* nothing is registered. Returns the number of callbacks run, -1 if one failed.
+*/
+static int
+loop_run(event_loop *loop, bool until_stopped, bool once, unsigned long deadline)
+{
+    struct event_data *iterator;
+    struct post_data *post;
+    std::vector<event_data *> ready;
+    timer_wheel *timers = &loop->timers;
+    event_loop *outer_loop = current_loop;
+    int n, timeout, dispatched = 0;
+    unsigned long now, next;
+    unsigned long long poll_start, poll_end, clock, wall_offset;
+    long long lateness;
+    zts_timeval wall;
+    bool have_wakeup, advance, simulated = loop_simulated(loop);
+
+    have_wakeup = wakeup_open(loop) == 0;
+    current_loop = loop;
+    loop->running = true;
+    ProfiledLock timeout_handlers_ll(loop->timeout_handlers_mut, timeout_handlers_stats), fd_handlers_ll(loop->fd_handlers_mut, fd_handlers_stats);
+    if (have_wakeup && !loop->wakeup_polled)
+    {
+        zts_pollfd pollfd;
+        pollfd.fd = loop->wakeup_fd;
+        pollfd.events = ZTS_POLLIN;
+        pollfd.revents = 0;
+        loop->pollfds.push_back(pollfd);
+        loop->pollfd_handlers.push_back(NULL);
+        loop->wakeup_polled = true;
+    }
+    while (!loop->stop_requested &&
+        (until_stopped || loop->fd_handler_count > 0 || !timers_empty(timers) || post_pending(loop)))
+    {
+        pollset_apply(loop);
+        now = 0;
+        if (deadline != ULONG_MAX)
+        {
+            now = current_tick(loop);
+            /* run_once polls even when its timeout is zero */
+            if (!once && (long)(now - deadline) >= 0)
+                break;
         }
 
-        if (timeout_event_handlers)
+        /* Sleep until the next timer, or until woken up if there is none */
+        timeout = -1;
+        loop->poll_deadline = ULONG_MAX;
+        if (!timers_empty(timers))
+        {
+            now = current_tick(loop);
+            wheel_run(timers, now);
+            next = wheel_next_tick(timers);
+            timeout = (long)(next - now) <= 0 ? 0 : next - now > EVENT_MAX_POLL_MS ? EVENT_MAX_POLL_MS : next - now;
+            loop->poll_deadline = now + timeout;
+        }
+        if (deadline != ULONG_MAX)
         {
-            gettimeofday(&current_time, NULL);
-            timersub(&timeout_event_handlers->timeout, &current_time, &time_diff);
-            if (time_diff.tv_sec < 0)
-                n = 0;
-            else
+            /* The caller wants control back by its deadline */
+            next = (long)(deadline - now) <= 0 ? 0 : deadline - now > EVENT_MAX_POLL_MS ? EVENT_MAX_POLL_MS : deadline - now;
+            if (timeout < 0 || (unsigned long)timeout > next)
             {
-                // n = select(FD_SETSIZE, &fdset, NULL, NULL, &time_diff);
-                int timeout = time_diff.tv_sec * 1000l + time_diff.tv_usec / 1000l;
-                n = zts_poll(&fds[0], fds.size(), timeout);
+                timeout = next;
+                loop->poll_deadline = now + timeout;
             }
         }
-        else
+        /* Simulated time does not pass while polling, the clock jumps to poll_deadline instead */
+        advance = simulated && timeout > 0;
+        if (advance)
+        {
+            timeout = 0;
+        }
+        if (!have_wakeup && (timeout < 0 || timeout > EVENT_FALLBACK_POLL_MS))
+        {
+            /* Nobody can interrupt the wait, so never sleep long */
+            timeout = EVENT_FALLBACK_POLL_MS;
+        }
+        if (post_pending(loop))
+        {
+            timeout = 0;
+        }
+
+        loop->polling = timeout != 0;
+        fd_handlers_ll.unlock();
+        timeout_handlers_ll.unlock();
+        // n = select(FD_SETSIZE, &fdset, NULL, NULL, &time_diff);
+        poll_start = monotonic_ns();
+        n = loop->transport->poll(loop->pollfds.data(), loop->pollfds.size(), timeout);
+        poll_end = monotonic_ns();
+        loop->stats.poll_wait.record(poll_end - poll_start);
+        if (advance && n == 0 && !post_pending(loop))
         {
-            // n = select(FD_SETSIZE, &fdset, NULL, NULL, NULL);
-            n = zts_poll(&fds[0], fds.size(), 0);
+            /* Idle until the next timer or the deadline: skip the wait */
+            loop->virtual_us.store((unsigned long long)loop->poll_deadline * 1000ULL, std::memory_order_release);
         }
+        /* Timeouts are times of the loop's clock, the offset maps the monotonic clock onto them (modulo 2^64, like the ticks) */
+        event_loop_time(loop, &wall);
+        wall_offset = (unsigned long long)wall.tv_sec * 1000000000ULL + wall.tv_usec * 1000ULL - poll_end;
+        clock = poll_end;
+        timeout_handlers_ll.lock();
+        fd_handlers_ll.lock();
+        loop->polling = false;
 
         if (n == -1)
         {
+            if (once)
+                break;
             continue;
         }
-        if (n == 0 && timeout_event_handlers)
+
+        /* Each pollfd slot maps straight to its handler, stop once all ready ones are found */
+        ready.clear();
+        for (size_t slot = 0; n > 0 && slot < loop->pollfds.size(); slot++)
+        {
+            if (loop->pollfds[slot].revents == 0)
+                continue;
+            n--;
+            if (loop->pollfd_handlers[slot] == NULL)
+                wakeup_drain(loop);
+            else if (loop->pollfds[slot].revents & ZTS_POLLIN)
+                ready.push_back(loop->pollfd_handlers[slot]);
+        }
+
+        /* Run what other threads posted before dispatching the events */
+        if (post_pending(loop))
+        {
+            fd_handlers_ll.unlock();
+            timeout_handlers_ll.unlock();
+            clock = monotonic_ns();
+            while ((post = post_pop(loop)) != NULL)
+            {
+                if (callback_run(loop, "event_post", post->callback, 0, post->callback_arg, &clock) < 0)
+                {
+                    post_pool.destroy(post);
+                    loop->running = outer_loop == loop;
+                    current_loop = outer_loop;
+                    return -1;
+                }
+                post_pool.destroy(post);
+                dispatched++;
+            }
+            timeout_handlers_ll.lock();
+            fd_handlers_ll.lock();
+        }
+
+        /*
+        * Fire every timer due by now as one batch, then serve the readable
+        * sockets. The expired list only shrinks meanwhile: a timer re-armed
+        * by its callback goes back into the wheel and is due next iteration.
+        */
+        if (!timers_empty(timers))
+        {
+            wheel_run(timers, current_tick(loop));
+        }
+        while ((iterator = timers->expired) != NULL)
         { /* Timeout */
-            iterator = timeout_event_handlers;
-            timeout_event_handlers = timeout_event_handlers->next;
+            timer_unlink(timers, iterator);
+            iterator->running = true;
             #ifdef DEBUG
                 fprintf(stderr, "eventloop: timeout : %s[arg: %x]\n",
                 e->e_string, (int)e->e_arg);
             #endif /* DEBUG */
-            if ((*iterator->callback)(0, iterator->callback_arg) < 0)
+            fd_handlers_ll.unlock();
+            timeout_handlers_ll.unlock();
+            lateness = (long long)(clock + wall_offset -
+                ((unsigned long long)iterator->timeout.tv_sec * 1000000000ULL + iterator->timeout.tv_usec * 1000ULL));
+            loop->stats.timer_lateness.record(lateness > 0 ? lateness : 0);
+            if (callback_run(loop, iterator->id, iterator->callback, 0, iterator->callback_arg, &clock) < 0)
             {
+                loop->running = outer_loop == loop;
+                current_loop = outer_loop;
                 return -1;
             }
+            dispatched++;
+            timeout_handlers_ll.lock();
+            fd_handlers_ll.lock();
+            iterator->running = false;
             switch(iterator->e_type)
             {
                 case event_data::TIME_EVENT:
-                    free(iterator);
+                    if (iterator->pprev == NULL && iterator->period && !iterator->deleted)
+                    {
+                        /* Periodic: next period on the original phase, or one period from now if it is past already */
+                        now = timers->base - 1;
+                        iterator->expires += iterator->period;
+                        if ((long)(iterator->expires - now) <= 0)
+                            iterator->expires = now + iterator->period;
+                        iterator->timeout = tick_to_timeval(iterator->expires);
+                        wheel_add(timers, iterator);
+                    }
+                    /* Keep the timer if the callback re-armed it */
+                    if (iterator->pprev == NULL)
+                        record_free(iterator);
                     break;
                 default:
                     fprintf(stderr, "eventloop: illegal e_type:%d\n", iterator->e_type);
             }
-            continue;
         }
-        iterator = fd_event_handlers;
-        while (iterator)
+
+        /* Handlers deregistered meanwhile stay allocated until the next pollset_apply() */
+        for (auto handler : ready)
         {
-            bool readable = false;
-            for(auto &fd : fds)
+            if (handler->deleted)
+                continue;
+            #ifdef DEBUG
+            fprintf(stderr, "eventloop: socket rcv: %s[fd: %d arg: %x]\n",
+            e->e_string, e->e_fd, (int)e->e_arg);
+            #endif /* DEBUG */
+            fd_handlers_ll.unlock();
+            timeout_handlers_ll.unlock();
+            if (callback_run(loop, handler->id, handler->callback, handler->fd, handler->callback_arg, &clock) < 0)
             {
-                if(fd.fd == iterator->fd && (fd.revents & ZTS_POLLIN))
-                {
-                    readable = true;
-                }
+                loop->running = outer_loop == loop;
+                current_loop = outer_loop;
+                return -1;
             }
-            if (iterator->e_type == event_data::FILE_EVENT && readable)
+            dispatched++;
+            timeout_handlers_ll.lock();
+            fd_handlers_ll.lock();
+        }
+
+        /* Last, what the callbacks deferred to the end of the iteration */
+        if (!loop->deferred.empty())
+        {
+            fd_handlers_ll.unlock();
+            timeout_handlers_ll.unlock();
+            n = defer_run(loop, &clock);
+            if (n < 0)
             {
-                #ifdef DEBUG
-                fprintf(stderr, "eventloop: socket rcv: %s[fd: %d arg: %x]\n",
-                e->e_string, e->e_fd, (int)e->e_arg);
-                #endif /* DEBUG */
-                if ((*iterator->callback)(iterator->fd, iterator->callback_arg) < 0)
-                {
-                    return -1;
-                }
+                loop->running = outer_loop == loop;
+                current_loop = outer_loop;
+                return -1;
             }
-            iterator = iterator->next;
+            dispatched += n;
+            timeout_handlers_ll.lock();
+            fd_handlers_ll.lock();
         }
-
-        timeout_handlers_ll.unlock();
-        fd_handlers_ll.unlock();
-        zts_delay_ms(50);
-        timeout_handlers_ll.lock();
-        fd_handlers_ll.lock();
+        loop->stats.iteration.record(clock - poll_end);
+        if (once)
+            break;
     }
+    pollset_apply(loop);
+    loop->stop_requested = false;
+    loop->running = outer_loop == loop;
+    current_loop = outer_loop;
     #ifdef DEBUG
         fprintf(stderr, "eventloop: returning 0\n");
     #endif /* DEBUG */
-    return 0;
+    return dispatched;
+}
+
+/*
+* Rudp event loop.
+* Runs <loop> until no file descriptors or timers are registered with it.
+*/
+int
+eventloop(event_loop_t *loop)
+{
+    return loop_run(loop, false, false, ULONG_MAX) < 0 ? -1 : 0;
+}
+
+/*
+* Run <loop> until eventloop_stop(), also while nothing is registered. Used
+* by threads that serve a loop for its whole lifetime.
+*/
+int
+eventloop_run(event_loop_t *loop)
+{
+    return loop_run(loop, true, false, ULONG_MAX) < 0 ? -1 : 0;
+}
+
+/*
+* Run a single iteration of <loop>: wait at most <timeout_ms> milliseconds
+* (-1 for no limit, 0 to only check) for input, a due timer or a post, then
+* dispatch everything that is ready. For applications that drive RUDP from a
+* loop of their own. Returns the number of callbacks run, -1 if one failed.
+*/
+int
+eventloop_run_once(event_loop_t *loop, int timeout_ms)
+{
+    unsigned long deadline = ULONG_MAX;
+
+    if (timeout_ms >= 0)
+        deadline = current_tick(loop) + timeout_ms;
+    return loop_run(loop, true, true, deadline);
+}
+
+/*
+* Run <loop> until the absolute timestamp <deadline> or eventloop_stop(),
+* also while nothing is registered.
+*/
+int
+eventloop_run_until(event_loop_t *loop, zts_timeval deadline)
+{
+    return loop_run(loop, true, false, timeval_to_tick(&deadline)) < 0 ? -1 : 0;
 }
@@ -30,24 +30,101 @@ GNU General Public License for more details.
 * error, and the program is terminated.
 */
 
+#include <stdio.h>
+
 #include <ZeroTierSockets.h>
 
+#include "transport.h"
+
+/*
+* An event loop with its own file descriptors, timers and wakeup channel.
+* Each loop is driven by one thread at a time; several loops can run in
+* parallel on different threads. Events may be registered with a loop from
+* any thread.
+*/
+typedef struct event_loop event_loop_t;
+
+/*
+* Opaque handle of a registered timer. It is valid until the timer has fired
+* (and was not re-armed from its callback) or has been cancelled.
+*/
+typedef struct event_data *event_timer_t;
+
+/*
+* Latency statistics kept by every loop, see event_loop_latency()
+*/
+typedef enum {
+    EVENT_LATENCY_ITERATION, /* loop iteration, from poll return until its events are dispatched */
+    EVENT_LATENCY_POLL_WAIT, /* time blocked in the poll */
+    EVENT_LATENCY_TIMER_LATENESS, /* timer callback start minus its timeout */
+    EVENT_LATENCY_CALLBACK, /* execution time of the callbacks with a given id */
+} event_latency_t;
+
+struct event_latency {
+    unsigned long long count;
+    unsigned long long avg_ns;
+    unsigned long long p50_ns;
+    unsigned long long p99_ns;
+    unsigned long long max_ns;
+};
+
+/*
+* Event record allocator counters of a loop, see event_loop_alloc_stats()
+*/
+struct event_alloc_stats {
+    unsigned long long slab_mallocs; /* slabs allocated, each holding several records */
+    unsigned long long records_allocated; /* records handed out since the loop was created */
+    unsigned long records_in_use;
+    unsigned long records_in_use_max;
+    unsigned long records_free; /* allocated and on the free list */
+};
+
 /*
 * Prototypes
+* The idstr of an event is kept by pointer, not copied: pass a string literal
+* or another string that outlives the event (and the loop's statistics).
 */
-int event_timeout(zts_timeval timer,
+event_loop_t *event_loop_new();
+void event_loop_free(event_loop_t *loop);
+event_loop_t *event_loop_default();
+void event_loop_time(event_loop_t *loop, zts_timeval *now);
+int event_loop_set_clock(event_loop_t *loop, void (*clock)(zts_timeval *now, void *arg), void *arg);
+int event_loop_simulate(event_loop_t *loop, zts_timeval start);
+int event_loop_set_transport(event_loop_t *loop, const transport_t *transport);
+
+event_timer_t event_timeout(event_loop_t *loop, zts_timeval timer,
+int (*callback)(int, void*), void *callback_arg, const char *idstr);
+event_timer_t event_timeout_slack(event_loop_t *loop, zts_timeval timer, int slack_ms,
 int (*callback)(int, void*), void *callback_arg, const char *idstr);
+int event_loop_set_timer_slack(event_loop_t *loop, int slack_ms);
+int event_timer_cancel(event_timer_t timer);
+int event_timer_reschedule(event_timer_t timer, zts_timeval t);
+void *event_timer_arg(event_timer_t timer);
 
-int
-event_periodic(int secs,
+event_timer_t
+event_periodic(event_loop_t *loop, int interval_ms,
 int (*callback)(int, void*),
 void *callback_arg,
 const char *idstr);
 
-int event_timeout_delete(int (*callback)(int, void*), void *callback_arg);
-int event_fd_delete(int (*callback)(int, void*), void *callback_arg);
-int event_fd(int fd, int (*callback)(int, void*), void *callback_arg, 
+int event_timeout_delete(event_loop_t *loop, int (*callback)(int, void*), void *callback_arg);
+int event_fd_delete(event_loop_t *loop, int (*callback)(int, void*), void *callback_arg);
+int event_fd(event_loop_t *loop, int fd, int (*callback)(int, void*), void *callback_arg, 
              const char *idstr);
-int eventloop();
+int event_wakeup(event_loop_t *loop);
+int event_post(event_loop_t *loop, int (*callback)(int, void*), void *callback_arg);
+int event_defer(event_loop_t *loop, int (*callback)(int, void*), void *callback_arg);
+int event_defer_delete(event_loop_t *loop, int (*callback)(int, void*), void *callback_arg);
+event_loop_t *event_loop_current();
+int event_loop_latency(event_loop_t *loop, event_latency_t which, const char *id,
+                       struct event_latency *latency);
+void event_loop_latency_dump(event_loop_t *loop, FILE *out);
+void event_loop_latency_reset(event_loop_t *loop);
+void event_loop_alloc_stats(event_loop_t *loop, struct event_alloc_stats *stats);
+int eventloop(event_loop_t *loop);
+int eventloop_run(event_loop_t *loop);
+int eventloop_run_once(event_loop_t *loop, int timeout_ms);
+int eventloop_run_until(event_loop_t *loop, zts_timeval deadline);
+void eventloop_stop(event_loop_t *loop);
 
 #endif /* EVENT_H */
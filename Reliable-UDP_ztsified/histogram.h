@@ -0,0 +1,117 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <atomic>
+#include <ostream>
+
+#include <stdint.h>
+
+/**
+ * @brief a lock-free histogram with power of two buckets
+ * Bucket i counts the values in [2^(i-1), 2^i), bucket 0 counts zeroes.
+ * Recording is a handful of relaxed atomic increments, so it can be done
+ * from any thread on hot paths. Readers get a consistent enough snapshot
+ * for diagnostics, not an exact one.
+ */
+class Log2Histogram
+{
+public:
+    static constexpr int BUCKETS = 65;
+
+public:
+    auto record(uint64_t value) -> void
+    {
+        _buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        _sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t max = _max.load(std::memory_order_relaxed);
+        while(value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+            ;
+    }
+
+    auto count() const -> uint64_t
+    {
+        return _count.load(std::memory_order_relaxed);
+    }
+
+    auto sum() const -> uint64_t
+    {
+        return _sum.load(std::memory_order_relaxed);
+    }
+
+    auto max() const -> uint64_t
+    {
+        return _max.load(std::memory_order_relaxed);
+    }
+
+    auto bucket_count(int bucket) const -> uint64_t
+    {
+        return _buckets[bucket].load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief upper bound of the bucket holding the <p> quantile (0 <= p <= 1)
+     */
+    auto percentile(double p) const -> uint64_t
+    {
+        uint64_t total = 0;
+        for(int i = 0; i < BUCKETS; i++)
+        {
+            total += bucket_count(i);
+        }
+        uint64_t rank = (uint64_t)(p * total);
+        uint64_t seen = 0;
+        for(int i = 0; i < BUCKETS; i++)
+        {
+            seen += bucket_count(i);
+            if(seen > rank)
+            {
+                return upper_bound(i);
+            }
+        }
+        return max();
+    }
+
+    auto reset() -> void
+    {
+        for(auto &bucket : _buckets)
+        {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        _count.store(0, std::memory_order_relaxed);
+        _sum.store(0, std::memory_order_relaxed);
+        _max.store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief writes "n=.. avg=.. p50=.. p99=.. max=.." with the values in <unit>
+     */
+    auto dump(std::ostream &out, const char *unit) const -> void
+    {
+        uint64_t n = count();
+        out << "n=" << n
+            << " avg=" << (n ? sum() / n : 0) << unit
+            << " p50=" << percentile(0.5) << unit
+            << " p99=" << percentile(0.99) << unit
+            << " max=" << max() << unit;
+    }
+
+private:
+    static auto bucket(uint64_t value) -> int
+    {
+        return value ? 64 - __builtin_clzll(value) : 0;
+    }
+
+    static auto upper_bound(int bucket) -> uint64_t
+    {
+        return bucket == 0 ? 0 : bucket == 64 ? UINT64_MAX : (1ULL << bucket) - 1;
+    }
+
+private:
+    std::atomic<uint64_t> _buckets[BUCKETS] = {};
+    std::atomic<uint64_t> _count{0};
+    std::atomic<uint64_t> _sum{0};
+    std::atomic<uint64_t> _max{0};
+};
+
+#endif // _HISTOGRAM_H_
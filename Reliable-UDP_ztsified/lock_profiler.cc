@@ -0,0 +1,63 @@
+#include <lock_profiler.h>
+
+#ifdef RUDP_LOCK_PROFILING
+
+/* Registered LockStats, pushed by their constructors */
+static std::atomic<LockStats *> lock_stats_head(nullptr);
+
+LockStats::LockStats(const char *name) :
+    _name(name),
+    _next(lock_stats_head.load(std::memory_order_relaxed))
+{
+    while(!lock_stats_head.compare_exchange_weak(_next, this, std::memory_order_release, std::memory_order_relaxed))
+        ;
+}
+
+auto LockStats::dump(std::ostream &out) const -> void
+{
+    out << "mutex " << _name
+        << " acquisitions=" << _acquisitions.load(std::memory_order_relaxed)
+        << " contended=" << _contended.load(std::memory_order_relaxed)
+        << " wait[";
+    _wait.dump(out, "ns");
+    out << "] hold[";
+    _hold.dump(out, "ns");
+    out << "]" << std::endl;
+}
+
+auto LockStats::reset() -> void
+{
+    _acquisitions.store(0, std::memory_order_relaxed);
+    _contended.store(0, std::memory_order_relaxed);
+    _wait.reset();
+    _hold.reset();
+}
+
+auto lock_profile_dump(std::ostream &out) -> void
+{
+    for(LockStats *stats = lock_stats_head.load(std::memory_order_acquire); stats; stats = stats->_next)
+    {
+        stats->dump(out);
+    }
+}
+
+auto lock_profile_reset() -> void
+{
+    for(LockStats *stats = lock_stats_head.load(std::memory_order_acquire); stats; stats = stats->_next)
+    {
+        stats->reset();
+    }
+}
+
+#else // RUDP_LOCK_PROFILING
+
+auto lock_profile_dump(std::ostream &out) -> void
+{
+    out << "lock profiling disabled, build with -DRUDP_LOCK_PROFILING" << std::endl;
+}
+
+auto lock_profile_reset() -> void
+{
+}
+
+#endif // RUDP_LOCK_PROFILING
@@ -0,0 +1,171 @@
+#ifndef _LOCK_PROFILER_H_
+#define _LOCK_PROFILER_H_
+
+#include <mutex>
+#include <ostream>
+
+#ifdef RUDP_LOCK_PROFILING
+#include <atomic>
+#include <chrono>
+
+#include <histogram.h>
+#endif
+
+/*
+ * Lock contention profiler.
+ *
+ * A ProfiledLock is used like a std::unique_lock. Built with
+ * -DRUDP_LOCK_PROFILING it records, per named mutex, how often the mutex was
+ * taken, how often it was already held by someone else, how long the taker
+ * waited for it and how long it was held. The numbers live in lock-free
+ * histograms and are printed by lock_profile_dump().
+ *
+ * Without RUDP_LOCK_PROFILING a LockStats is empty and a ProfiledLock is a
+ * plain std::unique_lock.
+ */
+
+#ifdef RUDP_LOCK_PROFILING
+
+/**
+ * @brief statistics of one named mutex (or of all mutexes sharing the name)
+ * Instances are meant to have static storage duration, they register
+ * themselves for lock_profile_dump() and are never unregistered.
+ */
+class LockStats
+{
+public:
+    explicit LockStats(const char *name);
+    LockStats(const LockStats &copy) = delete;
+
+public:
+    auto operator=(const LockStats &copy) -> LockStats & = delete;
+
+public:
+    auto acquired(bool contended, uint64_t wait_ns) -> void
+    {
+        _acquisitions.fetch_add(1, std::memory_order_relaxed);
+        if(contended)
+        {
+            _contended.fetch_add(1, std::memory_order_relaxed);
+            _wait.record(wait_ns);
+        }
+    }
+
+    auto released(uint64_t hold_ns) -> void
+    {
+        _hold.record(hold_ns);
+    }
+
+    auto dump(std::ostream &out) const -> void;
+    auto reset() -> void;
+
+private:
+    friend auto lock_profile_dump(std::ostream &out) -> void;
+    friend auto lock_profile_reset() -> void;
+
+    const char *_name;
+    std::atomic<uint64_t> _acquisitions{0};
+    std::atomic<uint64_t> _contended{0};
+    Log2Histogram _wait; /* ns spent blocked, contended acquisitions only */
+    Log2Histogram _hold; /* ns between acquisition and release */
+    LockStats *_next;
+};
+
+class ProfiledLock
+{
+public:
+    ProfiledLock(std::mutex &mutex, LockStats &stats) :
+        _lock(mutex, std::defer_lock),
+        _stats(stats)
+    {
+        lock();
+    }
+    ProfiledLock(const ProfiledLock &copy) = delete;
+    ~ProfiledLock()
+    {
+        if(_lock.owns_lock())
+        {
+            unlock();
+        }
+    }
+
+public:
+    auto operator=(const ProfiledLock &copy) -> ProfiledLock & = delete;
+
+public:
+    auto lock() -> void
+    {
+        if(_lock.try_lock())
+        {
+            _acquired_at = now_ns();
+            _stats.acquired(false, 0);
+            return;
+        }
+        uint64_t wait_start = now_ns();
+        _lock.lock();
+        _acquired_at = now_ns();
+        _stats.acquired(true, _acquired_at - wait_start);
+    }
+
+    auto unlock() -> void
+    {
+        _stats.released(now_ns() - _acquired_at);
+        _lock.unlock();
+    }
+
+private:
+    static auto now_ns() -> uint64_t
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    std::unique_lock<std::mutex> _lock;
+    LockStats &_stats;
+    uint64_t _acquired_at = 0;
+};
+
+#else // RUDP_LOCK_PROFILING
+
+class LockStats
+{
+public:
+    constexpr explicit LockStats(const char *) {}
+};
+
+class ProfiledLock
+{
+public:
+    ProfiledLock(std::mutex &mutex, LockStats &) :
+        _lock(mutex)
+    {
+    }
+
+public:
+    auto lock() -> void
+    {
+        _lock.lock();
+    }
+
+    auto unlock() -> void
+    {
+        _lock.unlock();
+    }
+
+private:
+    std::unique_lock<std::mutex> _lock;
+};
+
+#endif // RUDP_LOCK_PROFILING
+
+/**
+ * @brief writes one line per registered LockStats to <out>
+ */
+auto lock_profile_dump(std::ostream &out) -> void;
+
+/**
+ * @brief zeroes every registered LockStats, e.g. after a warm-up phase
+ */
+auto lock_profile_reset() -> void;
+
+#endif // _LOCK_PROFILER_H_
@@ -0,0 +1,245 @@
+#ifndef _OBJECT_POOL_H_
+#define _OBJECT_POOL_H_
+
+#include <atomic>
+#include <new>
+#include <utility>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define OBJECT_POOL_MAX 32 /* Pools a process can have, each thread caches blocks of every one */
+
+/**
+ * @brief counters of an ObjectPool
+ */
+struct object_pool_stats
+{
+    const char *name;
+    uint64_t slab_mallocs; /* slabs allocated, each holding several blocks */
+    uint64_t allocated; /* blocks handed out since the pool was created */
+    uint64_t in_use;
+    uint64_t in_use_max; /* high-water mark of in_use */
+};
+
+/**
+ * @brief a free list of fixed size blocks for the objects of one type
+ * Blocks are carved out of slabs that are never returned to the heap, and
+ * released blocks go back onto the free list. Once a pool has seen its peak
+ * number of blocks in use, allocating from it costs no malloc. Nothing
+ * locks: blocks are released by pushing them onto a lock-free stack, and a
+ * thread allocating moves the whole stack into a cache of its own with one
+ * exchange, so no two threads ever pop the same list. Blocks may thus be
+ * allocated on one thread and released on another, and posting work to an
+ * event loop never waits for another thread.
+ * Instances are meant to have static storage duration, they register
+ * themselves for ObjectPool::first() and are never unregistered.
+ */
+class ObjectPool
+{
+public:
+    ObjectPool(const char *name, size_t block_size, int slab_blocks) :
+        _name(name),
+        _block_size(round_up(block_size)),
+        _slab_blocks(slab_blocks),
+        _index(pools_count().fetch_add(1, std::memory_order_relaxed)),
+        _next(pools_head().load(std::memory_order_relaxed))
+    {
+        if(_index >= OBJECT_POOL_MAX)
+        {
+            fprintf(stderr, "ObjectPool: more than %d pools\n", OBJECT_POOL_MAX);
+            abort();
+        }
+        while(!pools_head().compare_exchange_weak(_next, this, std::memory_order_release, std::memory_order_relaxed))
+            ;
+    }
+    ObjectPool(const ObjectPool &copy) = delete;
+
+public:
+    auto operator=(const ObjectPool &copy) -> ObjectPool & = delete;
+
+public:
+    /**
+     * @brief a block of at least <block_size> bytes, nullptr if out of memory
+     */
+    auto allocate() -> void *
+    {
+        free_block *&cache = thread_cache(this);
+        if(cache == nullptr)
+        {
+            cache = _free.exchange(nullptr, std::memory_order_acquire);
+            if(cache == nullptr && !grow(cache))
+            {
+                return nullptr;
+            }
+        }
+        free_block *block = cache;
+        cache = block->next;
+        _allocated.fetch_add(1, std::memory_order_relaxed);
+        uint64_t in_use = _in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+        uint64_t in_use_max = _in_use_max.load(std::memory_order_relaxed);
+        while(in_use > in_use_max && !_in_use_max.compare_exchange_weak(in_use_max, in_use, std::memory_order_relaxed))
+            ;
+        return block;
+    }
+
+    auto release(void *object) -> void
+    {
+        if(object == nullptr)
+        {
+            return;
+        }
+        free_block *block = static_cast<free_block *>(object);
+        push(block, block);
+        _in_use.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief an object constructed in a block of the pool, nullptr if out of memory
+     */
+    template<typename T, typename... Args>
+    auto create(Args &&... args) -> T *
+    {
+        static_assert(alignof(T) <= alignof(max_align_t), "blocks are aligned for max_align_t only");
+        void *block = allocate();
+        return block != nullptr ? new (block) T(std::forward<Args>(args)...) : nullptr;
+    }
+
+    template<typename T>
+    auto destroy(T *object) -> void
+    {
+        if(object != nullptr)
+        {
+            object->~T();
+            release(object);
+        }
+    }
+
+    auto stats() -> object_pool_stats
+    {
+        return object_pool_stats{_name, _slab_mallocs.load(std::memory_order_relaxed), _allocated.load(std::memory_order_relaxed),
+            _in_use.load(std::memory_order_relaxed), _in_use_max.load(std::memory_order_relaxed)};
+    }
+
+    auto next() const -> ObjectPool *
+    {
+        return _next;
+    }
+
+    /**
+     * @brief the most recently constructed pool, the others follow through next()
+     */
+    static auto first() -> ObjectPool *
+    {
+        return pools_head().load(std::memory_order_acquire);
+    }
+
+private:
+    struct free_block
+    {
+        free_block *next;
+    };
+
+    /* Every slab starts with a link to the previous one, so they stay reachable */
+    struct slab
+    {
+        slab *next;
+        alignas(max_align_t) char blocks[1];
+    };
+
+    /* The blocks a thread took from each pool, handed back when the thread exits */
+    struct thread_caches
+    {
+        ObjectPool *pools[OBJECT_POOL_MAX];
+        free_block *lists[OBJECT_POOL_MAX];
+
+        ~thread_caches()
+        {
+            for(int i = 0; i < OBJECT_POOL_MAX; i++)
+            {
+                free_block *last = lists[i];
+                while(last != nullptr && last->next != nullptr)
+                {
+                    last = last->next;
+                }
+                if(last != nullptr)
+                {
+                    pools[i]->push(lists[i], last);
+                }
+            }
+        }
+    };
+
+    static auto round_up(size_t size) -> size_t
+    {
+        size = size < sizeof(free_block) ? sizeof(free_block) : size;
+        return (size + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t);
+    }
+
+    static auto pools_head() -> std::atomic<ObjectPool *> &
+    {
+        static std::atomic<ObjectPool *> head(nullptr);
+        return head;
+    }
+
+    static auto pools_count() -> std::atomic<int> &
+    {
+        static std::atomic<int> count(0);
+        return count;
+    }
+
+    static auto thread_cache(ObjectPool *pool) -> free_block *&
+    {
+        static thread_local thread_caches caches = {};
+        caches.pools[pool->_index] = pool;
+        return caches.lists[pool->_index];
+    }
+
+    /* Pushes the chain of blocks from <first> to <last> onto the free stack */
+    auto push(free_block *first, free_block *last) -> void
+    {
+        free_block *head = _free.load(std::memory_order_relaxed);
+        do
+        {
+            last->next = head;
+        } while(!_free.compare_exchange_weak(head, first, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    /* Carves a new slab into blocks and puts them on the calling thread's <cache> */
+    auto grow(free_block *&cache) -> bool
+    {
+        slab *new_slab = static_cast<slab *>(malloc(offsetof(slab, blocks) + _block_size * _slab_blocks));
+        if(new_slab == nullptr)
+        {
+            return false;
+        }
+        new_slab->next = _slabs.load(std::memory_order_relaxed);
+        while(!_slabs.compare_exchange_weak(new_slab->next, new_slab, std::memory_order_relaxed))
+            ;
+        _slab_mallocs.fetch_add(1, std::memory_order_relaxed);
+        for(int i = _slab_blocks - 1; i >= 0; i--)
+        {
+            free_block *block = reinterpret_cast<free_block *>(new_slab->blocks + _block_size * i);
+            block->next = cache;
+            cache = block;
+        }
+        return true;
+    }
+
+private:
+    const char *_name;
+    const size_t _block_size;
+    const int _slab_blocks;
+    const int _index; /* of the pool's list in every thread_caches */
+    std::atomic<free_block *> _free{nullptr};
+    std::atomic<slab *> _slabs{nullptr};
+    std::atomic<uint64_t> _slab_mallocs{0};
+    std::atomic<uint64_t> _allocated{0};
+    std::atomic<uint64_t> _in_use{0};
+    std::atomic<uint64_t> _in_use_max{0};
+    ObjectPool *_next;
+};
+
+#endif // _OBJECT_POOL_H_
@@ -1,10 +1,18 @@
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
 
 #include "event.h"
+#include "object_pool.h"
 #include "rudp.h"
 #include "rudp_api.h"
 
@@ -15,38 +23,83 @@
  * Author: Andrew Keating
  */
 
-#define DROP 0 /* Probability of packet loss */
-
 typedef enum {SYN_SENT = 0, OPENING, OPEN, FIN_SENT} rudp_state_t; /* RUDP States */
 
+/*
+ * Payload of a message: the one copy of the application's data, shared by
+ * its queue entry, its DATA packet, the retransmission timer and the send
+ * queue. Freed with the last reference. After rudp_sendto() it is only
+ * touched by the loop thread of its socket.
+ */
+struct payload_buffer
+{
+    int refs;
+    int len;
+    char *data() { return (char *)(this + 1); }
+};
+
 struct rudp_packet
 {
     rudp_hdr header;
-    int payload_length;
-    char payload[RUDP_MAXPKTSIZE];
+    uint16_t flags; /* RUDP_FLAG_ bits sent in the type field, version 2 only */
+    payload_buffer *payload; /* NULL for packets without payload */
+};
+
+/* A datagram in the send queue of a socket, gathered from the header in <head> and the payload */
+struct send_slot
+{
+    char head[sizeof(rudp_hdr) + sizeof(int32_t)]; /* the header, and the payload length of version 1 */
+    payload_buffer *payload; /* reference held until the datagram is sent */
 };
 
+/*
+ * Payload bytes the engine copies, counted when built with
+ * -DRUDP_COPY_STATS, see rudp_copy_stats()
+ */
+#ifdef RUDP_COPY_STATS
+std::atomic<unsigned long long> copy_stats[4];
+#define COPY_STATS_ADD(which, n) copy_stats[which].fetch_add(n, std::memory_order_relaxed)
+#else
+#define COPY_STATS_ADD(which, n) ((void)0)
+#endif
+enum {SEND_ACCEPTED, SEND_COPIED, RECEIVE_DELIVERED, RECEIVE_COPIED};
+
 /* Outgoing data queue */
 struct data
 {
-    void *item;
-    int len;
+    payload_buffer *payload;
     data *next;
 };
 
+/* A DATA packet in flight, kept until it is ACKed */
+struct window_slot
+{
+    rudp_packet *packet; /* NULL once a SACK reported it */
+    int retransmission_attempts;
+    event_timer_t timer; /* Retransmission timer */
+    bool fast_retransmitted; /* Retransmitted because SACKed packets overtook it */
+};
+
 struct sender_session
 {
     rudp_state_t status; /* Protocol state */
-    uint32_t seqno;
-    rudp_packet *sliding_window[RUDP_WINDOW];
-    int retransmission_attempts[RUDP_WINDOW];
+    uint32_t seqno; /* Last sequence number sent */
+    /*
+     * Sliding window: the DATA packets window_base up to seqno are in
+     * flight, in a ring indexed by sequence number. window_size limits how
+     * many that may be, the ring only grows.
+     */
+    window_slot *window;
+    uint32_t window_capacity; /* Slots in the ring, a power of two */
+    uint32_t window_base; /* Oldest unacknowledged sequence number */
+    int window_size;
     data *data_queue; /* Queue of unsent data */
     bool session_finished; /* Has the FIN we sent been ACKed? */
-    void *syn_timeout_arg; /* Argument pointer used to delete SYN timeout event */
-    void *fin_timeout_arg; /* Argument pointer used to delete FIN timeout event */
-    void *data_timeout_arg[RUDP_WINDOW]; /* Argument pointers used to delete DATA timeout events */
+    event_timer_t syn_timer; /* Retransmission timer of the SYN */
+    event_timer_t fin_timer; /* Retransmission timer of the FIN */
     int syn_retransmit_attempts;
     int fin_retransmit_attempts;
+    uint16_t peer_version; /* Wire format of our DATA packets, from the ACK of the SYN */
 };
 
 struct receiver_session
@@ -54,6 +107,18 @@ struct receiver_session
     rudp_state_t status; /* Protocol state */
     uint32_t expected_seqno;
     bool session_finished; /* Have we received a FIN from the sender? */
+    uint16_t peer_version; /* Wire format of the sender, from its SYN */
+    /*
+     * Reorder buffer: copies of the DATA packets that arrived ahead of
+     * expected_seqno, in a ring of payloads indexed by sequence number.
+     * Allocated when the first one arrives and grown to a power of two
+     * above the farthest one buffered, up to RUDP_REORDER_MAX.
+     */
+    payload_buffer **reorder;
+    uint32_t reorder_capacity;
+    uint32_t reorder_highest; /* Highest sequence number buffered */
+    int reorder_count;
+    int ack_pending; /* In-order DATA packets delivered but not ACKed yet */
 };
 
 struct session
@@ -72,34 +137,130 @@ struct rudp_socket_list
     int (*recv_handler)(rudp_socket_t, zts_sockaddr_in6 *, char *, int);
     int (*handler)(rudp_socket_t, rudp_event_t, zts_sockaddr_in6 *);
     session *sessions_list_head;
-    rudp_socket_list *next;
+    event_loop_t *loop; /* Event loop serving the socket */
+    const transport_t *transport; /* Transport the socket was opened with */
+    char recv_buffers[RUDP_RECV_BATCH][RUDP_LEGACY_PKTSIZE]; /* Receive buffers, refilled on every readiness event */
+    transport_datagram recv_batch[RUDP_RECV_BATCH];
+    send_slot send_slots[RUDP_SEND_BATCH]; /* Datagrams queued during the current loop iteration */
+    transport_datagram send_batch[RUDP_SEND_BATCH];
+    int send_count;
+    bool flush_deferred; /* flush_callback() is deferred to the end of the iteration */
+    int timer_slack; /* Slack of the retransmission timers in milliseconds */
+    int window; /* Window of the socket's sessions in packets */
+    int ack_every; /* In-order DATA packets ACKed at once, see rudp_delayed_ack() */
+    int ack_delay; /* Longest time an ACK is held back, in milliseconds */
+    event_timer_t ack_timer; /* Sends the ACKs held back, NULL when none are */
+    std::atomic<int> refs; /* Held by the socket map and by each command in flight, the last one frees the socket */
+    bool destroyed; /* Closed and out of the socket map, read on the loop thread only */
 };
 
 /* Arguments for timeout callback function */
 struct timeoutargs
 {
     rudp_socket_t fd;
+    rudp_socket_list *socket;
     rudp_packet *packet;
-    zts_sockaddr_in6 *recipient;
+    zts_sockaddr_in6 recipient;
+};
+
+/* Operation requested by an application thread, executed on the socket's event loop */
+struct socket_command
+{
+    enum {SENDTO, CLOSE, RECV_HANDLER, EVENT_HANDLER, TIMER_SLACK, WINDOW, DELAYED_ACK} type;
+    rudp_socket_t rsock;
+    rudp_socket_list *socket; /* Resolved from rsock when submitted, holds a reference */
+    payload_buffer *payload;
+    zts_sockaddr_in6 to;
+    int (*recv_handler)(rudp_socket_t, zts_sockaddr_in6 *, char *, int);
+    int (*handler)(rudp_socket_t, rudp_event_t, zts_sockaddr_in6 *);
+    int timer_slack;
+    int window;
+    int ack_every;
+    int ack_delay;
 };
 
 /* Prototypes */
 void create_sender_session(struct rudp_socket_list *socket, uint32_t seqno, struct zts_sockaddr_in6 *to, struct data **data_queue);
-void create_receiver_session(struct rudp_socket_list *socket, uint32_t seqno, struct zts_sockaddr_in6 *addr);
-rudp_packet *create_rudp_packet(uint16_t type, uint32_t seqno, int len, char *payload);
+int create_receiver_session(struct rudp_socket_list *socket, uint32_t seqno, uint16_t version, struct zts_sockaddr_in6 *addr);
+void init_receiver_session(receiver_session *receiver, uint32_t seqno, uint16_t version);
+void destroy_receiver_session(receiver_session *receiver);
+int reorder_resize(receiver_session *receiver, uint32_t distance);
+int reorder_insert(receiver_session *receiver, uint32_t seqno, const char *data, int len);
+payload_buffer *reorder_take(receiver_session *receiver, uint32_t seqno);
+int send_ack(struct rudp_socket_list *socket, session *curr_session);
+int ack_packet(struct rudp_socket_list *socket, zts_sockaddr_in6 *to, uint32_t seqno);
+int delay_ack(struct rudp_socket_list *socket, session *curr_session, int flags);
+int ack_timer_callback(int fd, void *arg);
+void destroy_sender_session(sender_session *sender);
+bool sessions_finished(struct rudp_socket_list *socket);
+void destroy_sessions(struct rudp_socket_list *socket);
+void send_fins(struct rudp_socket_list *socket);
+int window_in_flight(sender_session *sender);
+window_slot *window_find(sender_session *sender, uint32_t seqno);
+int window_resize(sender_session *sender, int size);
+void window_fill(struct rudp_socket_list *socket, session *curr_session);
+void window_release(window_slot *slot);
+bool window_ack(struct rudp_socket_list *socket, session *curr_session, uint32_t ackno, const char *sacks, int sack_count);
+payload_buffer *payload_alloc(const void *data, int len);
+payload_buffer *payload_ref(payload_buffer *payload);
+void payload_release(payload_buffer *payload);
+rudp_packet *create_rudp_packet(uint16_t type, uint32_t seqno, payload_buffer *payload);
+void packet_free(rudp_packet *packet);
+void encode_packet(rudp_packet *p, send_slot *slot, transport_datagram *datagram);
+int decode_packet(char *buf, int len, char **payload, int *payload_length, int *flags);
 int compare_sockaddr(struct zts_sockaddr_in6 *s1, struct zts_sockaddr_in6 *s2);
 int receive_callback(int file, void *arg);
+int receive_packet(struct rudp_socket_list *socket, int file, const rudp_hdr *header, int flags, char *received_payload, int received_length, struct zts_sockaddr_in6 *sender);
 int timeout_callback(int retry_attempts, void *args);
-int send_packet(bool is_ack, rudp_socket_t rsocket, struct rudp_packet *p, struct zts_sockaddr_in6 *recipient);
+int send_packet(bool is_ack, struct rudp_socket_list *socket, struct rudp_packet *p, struct zts_sockaddr_in6 *recipient);
+int transmit_packet(struct rudp_socket_list *socket, struct rudp_packet *p, struct zts_sockaddr_in6 *recipient);
+int flush_packets(struct rudp_socket_list *socket);
+int flush_callback(int fd, void *arg);
+int close_callback(int fd, void *arg);
+void destroy_socket(struct rudp_socket_list *socket);
+zts_timeval retransmission_deadline(event_loop_t *loop);
+void cancel_retransmission(event_timer_t *timer);
+rudp_socket_list *acquire_socket(rudp_socket_t rsocket);
+void release_socket(struct rudp_socket_list *socket);
+void remove_socket(struct rudp_socket_list *socket);
+int socket_sendto(struct rudp_socket_list *socket, payload_buffer *payload, zts_sockaddr_in6 *to);
+socket_command *create_command(int type, rudp_socket_t rsocket);
+void free_command(socket_command *cmd);
+int submit_command(socket_command *cmd);
+int execute_command(socket_command *cmd);
+int command_callback(int fd, void *arg);
 
 /* Global variables */
 bool rng_seeded = false;
-rudp_socket_list *socket_list_head = NULL;
+std::unordered_map<rudp_socket_t, rudp_socket_list *> socket_map; /* Open sockets by handle */
+std::shared_mutex socket_map_mut; /* Guards socket_map, application threads only look sockets up */
+
+/* Event loops of the engine, each served by its own thread */
+std::mutex engine_mut;
+std::vector<event_loop_t *> engine_loops;
+std::vector<std::thread> engine_threads;
+unsigned int engine_next_loop = 0;
+const transport_t *engine_transport = &transport_zts; /* Transport of new sockets and loops, guarded by engine_mut */
+
+/*
+ * Pools of the objects created per message and per session, so a socket
+ * in steady state sends and receives without touching the heap. Payload
+ * blocks are sized for the largest message rudp_sendto() accepts.
+ */
+#define RUDP_POOL_SLAB 64 /* Objects per slab of a pool */
+ObjectPool payload_pool("payload", sizeof(payload_buffer) + RUDP_MAXPKTSIZE, RUDP_POOL_SLAB);
+ObjectPool packet_pool("rudp_packet", sizeof(rudp_packet), RUDP_POOL_SLAB);
+ObjectPool timeoutargs_pool("timeoutargs", sizeof(timeoutargs), RUDP_POOL_SLAB);
+ObjectPool data_pool("data", sizeof(data), RUDP_POOL_SLAB);
+ObjectPool command_pool("socket_command", sizeof(socket_command), RUDP_POOL_SLAB);
+ObjectPool session_pool("session", sizeof(session), RUDP_POOL_SLAB);
+ObjectPool sender_session_pool("sender_session", sizeof(sender_session), RUDP_POOL_SLAB);
+ObjectPool receiver_session_pool("receiver_session", sizeof(receiver_session), RUDP_POOL_SLAB);
 
 /* Creates a new sender session and appends it to the socket's session list */
 void create_sender_session(struct rudp_socket_list *socket, uint32_t seqno, struct zts_sockaddr_in6 *to, struct data **data_queue)
 {
-    session *new_session = new (std::nothrow) session;
+    session *new_session = session_pool.create<session>();
     if(new_session == NULL)
     {
         std::cerr << "create_sender_session: Error allocating memory" << std::endl;
@@ -109,28 +270,35 @@ void create_sender_session(struct rudp_socket_list *socket, uint32_t seqno, stru
     new_session->next = NULL;
     new_session->receiver = NULL;
 
-    sender_session *new_sender_session = new (std::nothrow) sender_session;
+    sender_session *new_sender_session = sender_session_pool.create<sender_session>();
     if(new_sender_session == NULL)
     {
         std::cerr << "create_sender_session: Error allocating memory" << std::endl;
+        session_pool.destroy(new_session);
         return;
     }
     new_sender_session->status = SYN_SENT;
     new_sender_session->seqno = seqno;
     new_sender_session->session_finished = false;
+    new_sender_session->window = NULL;
+    new_sender_session->window_capacity = 0;
+    new_sender_session->window_base = seqno + 1;
+    if(window_resize(new_sender_session, socket->window) < 0)
+    {
+        std::cerr << "create_sender_session: Error allocating memory" << std::endl;
+        sender_session_pool.destroy(new_sender_session);
+        session_pool.destroy(new_session);
+        return;
+    }
     /* Add data to the new session's queue */
     new_sender_session->data_queue = *data_queue;
     new_session->sender = new_sender_session;
 
-    int i;
-    for(i = 0; i < RUDP_WINDOW; i++)
-    {
-        new_sender_session->retransmission_attempts[i] = 0;
-        new_sender_session->data_timeout_arg[i] = 0;
-        new_sender_session->sliding_window[i] = NULL;
-    }    
+    new_sender_session->syn_timer = NULL;
+    new_sender_session->fin_timer = NULL;
     new_sender_session->syn_retransmit_attempts = 0;
     new_sender_session->fin_retransmit_attempts = 0;
+    new_sender_session->peer_version = RUDP_VERSION;
     
     if(socket->sessions_list_head == NULL)
     {
@@ -147,28 +315,27 @@ void create_sender_session(struct rudp_socket_list *socket, uint32_t seqno, stru
     }
 }
 
-/* Creates a new receiver session and appends it to the socket's session list */
-void create_receiver_session(rudp_socket_list *socket, uint32_t seqno, zts_sockaddr_in6 *addr)
+/* Creates a new receiver session and appends it to the socket's session list. Returns 0 on success, -1 on error */
+int create_receiver_session(rudp_socket_list *socket, uint32_t seqno, uint16_t version, zts_sockaddr_in6 *addr)
 {
-    session *new_session = new (std::nothrow) session;
+    session *new_session = session_pool.create<session>();
     if(new_session == NULL)
     {
         std::cerr << "create_receiver_session: Error allocating memory" << std::endl;
-        return;
+        return -1;
     }
     new_session->address = *addr;
     new_session->next = NULL;
     new_session->sender = NULL;
     
-    receiver_session *new_receiver_session = new (std::nothrow) receiver_session;
+    receiver_session *new_receiver_session = receiver_session_pool.create<receiver_session>();
     if(new_receiver_session == NULL)
     {
         std::cerr << "create_receiver_session: Error allocating memory" << std::endl;
-        return;
+        session_pool.destroy(new_session);
+        return -1;
     }
-    new_receiver_session->status = OPENING;
-    new_receiver_session->session_finished = false;
-    new_receiver_session->expected_seqno = seqno;
+    init_receiver_session(new_receiver_session, seqno, version);
     new_session->receiver = new_receiver_session;
     
     if(socket->sessions_list_head == NULL)
@@ -184,626 +351,1045 @@ void create_receiver_session(rudp_socket_list *socket, uint32_t seqno, zts_socka
         }
         curr_session->next = new_session;
     }
+    return 0;
 }
 
-/* Allocates a RUDP packet and returns a pointer to it */
-rudp_packet *create_rudp_packet(uint16_t type, uint32_t seqno, int len, char *payload)
+/* Sets up a receiver session expecting <seqno> from a sender of wire format <version> */
+void init_receiver_session(receiver_session *receiver, uint32_t seqno, uint16_t version)
 {
-    rudp_hdr header;
-    header.version = RUDP_VERSION;
-    header.type = type;
-    header.seqno = seqno;
-    
-    rudp_packet *packet = new (std::nothrow) rudp_packet;
-    if(packet == NULL)
-    {
-        std::cerr << "create_rudp_packet: Error allocating memory for packet" << std::endl;
-        return NULL;
-    }
-    packet->header = header;
-    packet->payload_length = len;
-    memset(&packet->payload, 0, RUDP_MAXPKTSIZE);
-    if(payload != NULL)
-    {
-        memcpy(&packet->payload, payload, len);
-    }
-    
-    return packet;
+    receiver->status = OPENING;
+    receiver->session_finished = false;
+    receiver->expected_seqno = seqno;
+    receiver->peer_version = version;
+    receiver->reorder = NULL;
+    receiver->reorder_capacity = 0;
+    receiver->reorder_highest = seqno;
+    receiver->reorder_count = 0;
+    receiver->ack_pending = 0;
 }
 
-/* Returns 1 if the two sockaddr_in structs are equal and 0 if not */
-int compare_sockaddr(zts_sockaddr_in6 *s1, zts_sockaddr_in6 *s2)
+/* Frees a receiver session along with the packets in its reorder buffer */
+void destroy_receiver_session(receiver_session *receiver)
 {
-    char sender[ZTS_INET6_ADDRSTRLEN];
-    char recipient[ZTS_INET6_ADDRSTRLEN];
-    const char *err = zts_inet_ntop(ZTS_AF_INET6, &s1->sin6_addr, sender, ZTS_INET6_ADDRSTRLEN);
-    if(!err)
+    if(receiver->reorder != NULL)
     {
-        return 0;
+        for(uint32_t i = 0; i < receiver->reorder_capacity; i++)
+        {
+            payload_release(receiver->reorder[i]);
+        }
+        delete[] receiver->reorder;
     }
-    err = zts_inet_ntop(ZTS_AF_INET6, &s2->sin6_addr, recipient, ZTS_INET6_ADDRSTRLEN);
-    
-    return ((s1->sin6_family == s2->sin6_family) && (strcmp(sender, recipient) == 0) && (s1->sin6_port == s2->sin6_port));
+    receiver_session_pool.destroy(receiver);
 }
 
-/* Creates and returns a RUDP socket */
-rudp_socket_t rudp_socket(int port)
+/* Grows the reorder ring of a receiver session to hold packets up to <distance> ahead of the expected one */
+int reorder_resize(receiver_session *receiver, uint32_t distance)
 {
-    if(rng_seeded == false)
-    {
-        srand(time(NULL));
-        rng_seeded = true;
-    }
-    int sockfd;
-    zts_sockaddr_in6 address;
-
-    sockfd = zts_socket(ZTS_AF_INET6, ZTS_SOCK_DGRAM, 0);
-    if(sockfd < 0)
+    uint32_t capacity = receiver->reorder_capacity > 0 ? receiver->reorder_capacity : 1;
+    while(capacity <= distance)
     {
-        std::cerr << "Couldn't create socket: err: " << sockfd << " zts_errno: " << zts_errno << std::endl;
-        return (rudp_socket_t) -1;
+        capacity *= 2;
     }
-
-    memset(&address, 0, sizeof(address));
-    address.sin6_family = ZTS_AF_INET6;
-    int err = zts_inet_pton(ZTS_AF_INET6, "::", &address.sin6_addr);
-    if(err <= 0)
+    if(capacity != receiver->reorder_capacity)
     {
-        std::cerr << "Couldn't create zts_sockaddr_in6 from string address" << std::endl;
-        return (rudp_socket_t) -1;
+        payload_buffer **reorder = new (std::nothrow) payload_buffer *[capacity]();
+        if(reorder == NULL)
+        {
+            return -1;
+        }
+        /* The buffered packets move to their index in the larger ring */
+        for(uint32_t seqno = receiver->expected_seqno + 1; receiver->reorder_count > 0 && SEQ_LEQ(seqno, receiver->reorder_highest); seqno++)
+        {
+            reorder[seqno & (capacity - 1)] = receiver->reorder[seqno & (receiver->reorder_capacity - 1)];
+        }
+        delete[] receiver->reorder;
+        receiver->reorder = reorder;
+        receiver->reorder_capacity = capacity;
     }
-    address.sin6_port = zts_htons(port);
+    return 0;
+}
 
-    if((err = zts_bind(sockfd, (zts_sockaddr *)&address, sizeof(address))) < 0)
+/*
+ * Copies the payload of the DATA packet <seqno>, which is ahead of the
+ * expected one, into the reorder buffer. Returns 0 on success or if it is
+ * already buffered, -1 if it does not fit or on error.
+ */
+int reorder_insert(receiver_session *receiver, uint32_t seqno, const char *data, int len)
+{
+    if(seqno - receiver->expected_seqno >= RUDP_REORDER_MAX)
     {
-        std::cerr << "Couldn't bind socket to address: err: " << err << " zts_errno: " << zts_errno << std::endl;
-        return (rudp_socket_t) -1;
+        return -1;
     }
-
-    rudp_socket_t socket = (rudp_socket_t)sockfd;
-
-    /* Create new socket and add to list of sockets */
-    rudp_socket_list *new_socket = new (std::nothrow) rudp_socket_list;
-    if(new_socket == NULL)
+    if(seqno - receiver->expected_seqno >= receiver->reorder_capacity && reorder_resize(receiver, seqno - receiver->expected_seqno) < 0)
     {
-        std::cerr << "rudp_socket: Error allocating memory for socket list" << std::endl;
-        return (rudp_socket_t) -1;
+        std::cerr << "reorder_insert: Error allocating reorder buffer" << std::endl;
+        return -1;
     }
-    new_socket->rsock = socket;
-    new_socket->close_requested = false;
-    new_socket->sessions_list_head = NULL;
-    new_socket->next = NULL;
-    new_socket->handler = NULL;
-    new_socket->recv_handler = NULL;
-
-    if(socket_list_head == NULL)
+    payload_buffer **slot = &receiver->reorder[seqno & (receiver->reorder_capacity - 1)];
+    if(*slot != NULL)
     {
-        socket_list_head = new_socket;
+        return 0;
     }
-    else
+    *slot = payload_pool.create<payload_buffer>();
+    if(*slot == NULL)
     {
-        rudp_socket_list *curr = socket_list_head;
-        while(curr->next != NULL)
-        {
-            curr = curr->next;
-        }
-        curr->next = new_socket;
+        std::cerr << "reorder_insert: Error allocating memory for payload" << std::endl;
+        return -1;
     }
-
-    /* Register callback event for this socket descriptor */
-    if(event_fd(sockfd, receive_callback, (void*) sockfd, "receive_callback") < 0)
+    (*slot)->refs = 1;
+    (*slot)->len = len;
+    memcpy((*slot)->data(), data, len);
+    COPY_STATS_ADD(RECEIVE_COPIED, len);
+    receiver->reorder_count++;
+    if(receiver->reorder_count == 1 || SEQ_GT(seqno, receiver->reorder_highest))
     {
-        std::cerr << "Error registering receive callback function" << std::endl;
+        receiver->reorder_highest = seqno;
     }
-
-    return socket;
+    return 0;
 }
 
-/* Callback function executed when something is received on fd */
-int receive_callback(int file, void *arg)
+/* Removes the DATA packet <seqno> from the reorder buffer and returns its payload, NULL if it is not buffered */
+payload_buffer *reorder_take(receiver_session *receiver, uint32_t seqno)
 {
-    char buf[sizeof(rudp_packet)];
-    struct zts_sockaddr_in6 sender;
-    zts_socklen_t sender_length = sizeof(zts_sockaddr_in6);
-    zts_recvfrom(file, &buf, sizeof(rudp_packet), 0, (zts_sockaddr *)&sender, &sender_length);
-
-    struct rudp_packet *received_packet = new (std::nothrow) rudp_packet;
-    if(received_packet == NULL)
+    if(receiver->reorder_count == 0)
     {
-        std::cerr << "receive_callback: Error allocating packet" << std::endl;
-        return -1;
+        return NULL;
     }
-    memcpy(received_packet, &buf, sizeof(rudp_packet));
-    
-    rudp_hdr rudpheader = received_packet->header;
-    char type[5];
-    short t = rudpheader.type;
-    if(t == 1)
-        strcpy(type, "DATA");
-    else if(t == 2)
-        strcpy(type, "ACK");
-    else if(t == 4)
-        strcpy(type, "SYN");
-    else if(t==5)
-        strcpy(type, "FIN");
-    else
-        strcpy(type, "BAD");
-
-    char sender_str[ZTS_INET6_ADDRSTRLEN];
-    const char *err = zts_inet_ntop(ZTS_AF_INET6, &sender.sin6_addr, sender_str, ZTS_INET6_ADDRSTRLEN);
-    printf("Received %s packet from %s:%d seq number=%u on socket=%d\n",type, sender_str, zts_ntohs(sender.sin6_port), rudpheader.seqno, file);
-
-    /* Locate the correct socket in the socket list */
-    if(socket_list_head == NULL)
+    payload_buffer **slot = &receiver->reorder[seqno & (receiver->reorder_capacity - 1)];
+    payload_buffer *payload = *slot;
+    if(payload != NULL)
     {
-        std::cerr << "Error: attempt to receive on invalid socket. No sockets in the list" << std::endl;
-        return -1;
+        *slot = NULL;
+        receiver->reorder_count--;
     }
-    else
+    return payload;
+}
+
+/*
+ * ACKs everything before the expected sequence number of a receiver
+ * session. Version 2 senders also get the runs of packets in the reorder
+ * buffer as SACK ranges.
+ */
+int send_ack(rudp_socket_list *socket, session *curr_session)
+{
+    receiver_session *receiver = curr_session->receiver;
+    receiver->ack_pending = 0;
+    payload_buffer *sacks = NULL;
+    if(receiver->reorder_count > 0 && receiver->peer_version == RUDP_VERSION)
     {
-        /* We have sockets to check */
-        rudp_socket_list *curr_socket = socket_list_head;
-        while(curr_socket != NULL)
-        {
-            if(curr_socket->rsock == (rudp_socket_t)file)
-            {
-                break;
-            }
-            curr_socket = curr_socket->next;
-        }
-        if(curr_socket->rsock == (rudp_socket_t)file)
+        sacks = payload_pool.create<payload_buffer>();
+        if(sacks != NULL)
         {
-            /* We found the correct socket, now see if a session already exists for this peer */
-            if(curr_socket->sessions_list_head == NULL)
-            {
-                /* The list is empty, so we check if the sender has initiated the protocol properly (by sending a SYN) */
-                if(rudpheader.type == RUDP_SYN)
-                {
-                    /* SYN Received. Create a new session at the head of the list */
-                    uint32_t seqno = rudpheader.seqno + 1;
-                    create_receiver_session(curr_socket, seqno, &sender);
-                    /* Respond with an ACK */
-                    rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, 0, NULL);
-                    send_packet(true, (rudp_socket_t)file, p, &sender);
-                    delete p;
-                }
-                else
-                {
-                    /* No sessions exist and we got a non-SYN, so ignore it */
-                }
-            }
-            else
+            rudp_sack *ranges = (rudp_sack *)sacks->data();
+            int count = 0;
+            uint32_t seqno = receiver->expected_seqno + 1;
+            while(count < RUDP_SACK_MAX && SEQ_LEQ(seqno, receiver->reorder_highest))
             {
-                /* Some sessions exist to be checked */
-                bool session_found = false;
-                session *curr_session = curr_socket->sessions_list_head;
-                session *last_session;
-                while(curr_session != NULL)
-                {
-                    if(curr_session->next == NULL)
-                    {
-                        last_session = curr_session;
-                    }
-                    if(compare_sockaddr(&curr_session->address, &sender) == 1)
-                    {
-                        /* Found an existing session */
-                        session_found = true;
-                        break;
-                    }
-
-                    curr_session = curr_session->next;
-                }
-                if(session_found == false)
+                if(receiver->reorder[seqno & (receiver->reorder_capacity - 1)] == NULL)
                 {
-                    /* No session was found for this peer */
-                    if(rudpheader.type == RUDP_SYN)
-                    {
-                        /* SYN Received. Send an ACK and create a new session */
-                        uint32_t seqno = rudpheader.seqno + 1;
-                        create_receiver_session(curr_socket, seqno, &sender);          
-                        rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, 0, NULL);
-                        send_packet(true, (rudp_socket_t)file, p, &sender);
-                        delete p;
-                    }
-                    else
-                    {
-                        /* Session does not exist and non-SYN received - ignore it */
-                    }
+                    seqno++;
+                    continue;
                 }
-                else
+                ranges[count].start = seqno;
+                while(SEQ_LEQ(seqno, receiver->reorder_highest) && receiver->reorder[seqno & (receiver->reorder_capacity - 1)] != NULL)
                 {
-                /* We found a matching session */ 
-                    if(rudpheader.type == RUDP_SYN)
-                    {
-                        if(curr_session->receiver == NULL || curr_session->receiver->status == OPENING)
-                        {
-                            /* Create a new receiver session and ACK the SYN*/
-                            receiver_session *new_receiver_session = new (std::nothrow) receiver_session;
-                            if(new_receiver_session == NULL)
-                            {
-                                std::cerr << "receive_callback: Error allocating receiver session" << std::endl;
-                                return -1;
-                            }
-                            new_receiver_session->expected_seqno = rudpheader.seqno + 1;
-                            new_receiver_session->status = OPENING;
-                            new_receiver_session->session_finished = false;
-                            curr_session->receiver = new_receiver_session;
-
-                            int32_t seqno = curr_session->receiver->expected_seqno;
-                            rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, 0, NULL);
-                            send_packet(true, (rudp_socket_t)file, p, &sender);
-                            delete p;
-                        }
-                        else
-                        {
-                            /* Received a SYN when there is already an active receiver session, so we ignore it */
-                        }
-                    }
-                    if(rudpheader.type == RUDP_ACK)
-                    {
-                        uint32_t ack_sqn = received_packet->header.seqno;
-                        if(curr_session->sender->status == SYN_SENT)
-                        {
-                            /* This an ACK for a SYN */
-                            uint32_t syn_sqn = curr_session->sender->seqno;
-                            if((ack_sqn - 1) == syn_sqn)
-                            {
-                                /* Delete the retransmission timeout */
-                                event_timeout_delete(timeout_callback, curr_session->sender->syn_timeout_arg);
-                                timeoutargs *t = (struct timeoutargs *)curr_session->sender->syn_timeout_arg;
-                                delete t->packet;
-                                delete t->recipient;
-                                delete t;
-                                curr_session->sender->status = OPEN;
-                                while(curr_session->sender->data_queue != NULL)
-                                {
-                                    /* Check if the window is already full */
-                                    if(curr_session->sender->sliding_window[RUDP_WINDOW-1] != NULL)
-                                    {
-                                        break;
-                                    }
-                                    else
-                                    {
-                                        int index;
-                                        int i;
-                                        /* Find the first unused window slot */
-                                        for(i = RUDP_WINDOW-1; i >= 0; i--)
-                                        {
-                                            if(curr_session->sender->sliding_window[i] == NULL)
-                                            {
-                                                index = i;
-                                            }
-                                        }
-                                        /* Send packet, add to window and remove from queue */
-                                        u_int32_t seqno = ++syn_sqn;
-                                        int len = curr_session->sender->data_queue->len;
-                                        char *payload = (char *)curr_session->sender->data_queue->item;
-                                        rudp_packet *datap = create_rudp_packet(RUDP_DATA, seqno, len, payload);
-                                        curr_session->sender->seqno += 1;
-                                        curr_session->sender->sliding_window[index] = datap;
-                                        curr_session->sender->retransmission_attempts[index] = 0;
-                                        data *temp = curr_session->sender->data_queue;
-                                        curr_session->sender->data_queue = curr_session->sender->data_queue->next;
-                                        delete[] temp->item;
-                                        delete temp;
-
-                                        send_packet(false, (rudp_socket_t)file, datap, &sender);
-                                    }
-                                }
-                            }
-                        }
-                        else if(curr_session->sender->status == OPEN)
-                        {
-                            /* This is an ACK for DATA */
-                            if(curr_session->sender->sliding_window[0] != NULL)
-                            {
-                                if(curr_session->sender->sliding_window[0]->header.seqno == (rudpheader.seqno-1))
-                                {
-                                    /* Correct ACK received. Remove the first window item and shift the rest left */
-                                    event_timeout_delete(timeout_callback, curr_session->sender->data_timeout_arg[0]);
-                                    timeoutargs *args = (struct timeoutargs *)curr_session->sender->data_timeout_arg[0];
-                                    delete args->packet;
-                                    delete args->recipient;
-                                    delete args;
-                                    delete curr_session->sender->sliding_window[0];
-
-                                    int i;
-                                    if(RUDP_WINDOW == 1)
-                                    {
-                                        curr_session->sender->sliding_window[0] = NULL;
-                                        curr_session->sender->retransmission_attempts[0] = 0;
-                                        curr_session->sender->data_timeout_arg[0] = NULL;
-                                    }
-                                    else
-                                    {
-                                        for(i = 0; i < RUDP_WINDOW - 1; i++)
-                                        {
-                                            curr_session->sender->sliding_window[i] = curr_session->sender->sliding_window[i+1];
-                                            curr_session->sender->retransmission_attempts[i] = curr_session->sender->retransmission_attempts[i+1];
-                                            curr_session->sender->data_timeout_arg[i] = curr_session->sender->data_timeout_arg[i+1];
-
-                                            if(i == RUDP_WINDOW-2)
-                                            {
-                                                curr_session->sender->sliding_window[i+1] = NULL;
-                                                curr_session->sender->retransmission_attempts[i+1] = 0;
-                                                curr_session->sender->data_timeout_arg[i+1] = NULL;
-                                            }
-                                        }
-                                    }
-
-                                    while(curr_session->sender->data_queue != NULL)
-                                    {
-                                        if(curr_session->sender->sliding_window[RUDP_WINDOW-1] != NULL)
-                                        {
-                                            break;
-                                        }
-                                        else
-                                        {
-                                            int index;
-                                            int i;
-                                            /* Find the first unused window slot */
-                                            for(i = RUDP_WINDOW-1; i >= 0; i--)
-                                            {
-                                                if(curr_session->sender->sliding_window[i] == NULL)
-                                                {
-                                                    index = i;
-                                                }
-                                            }                      
-                                            /* Send packet, add to window and remove from queue */
-                                            curr_session->sender->seqno = curr_session->sender->seqno + 1;                      
-                                            uint32_t seqno = curr_session->sender->seqno;
-                                            int len = curr_session->sender->data_queue->len;
-                                            char *payload = (char *)curr_session->sender->data_queue->item;
-                                            rudp_packet *datap = create_rudp_packet(RUDP_DATA, seqno, len, payload);
-                                            curr_session->sender->sliding_window[index] = datap;
-                                            curr_session->sender->retransmission_attempts[index] = 0;
-                                            data *temp = curr_session->sender->data_queue;
-                                            curr_session->sender->data_queue = curr_session->sender->data_queue->next;
-                                            delete[] temp->item;
-                                            delete temp;
-                                            send_packet(false, (rudp_socket_t)file, datap, &sender);
-                                        }
-                                    }
-                                    if(curr_socket->close_requested)
-                                    {
-                                        /* Can the socket be closed? */
-                                        session *head_sessions = curr_socket->sessions_list_head;
-                                        while(head_sessions != NULL)
-                                        {
-                                            if(head_sessions->sender->session_finished == false)
-                                            {
-                                                if(head_sessions->sender->data_queue == NULL &&  
-                                                    head_sessions->sender->sliding_window[0] == NULL && 
-                                                    head_sessions->sender->status == OPEN)
-                                                {
-                                                    head_sessions->sender->seqno += 1;                      
-                                                    rudp_packet *p = create_rudp_packet(RUDP_FIN, head_sessions->sender->seqno, 0, NULL);
-                                                    send_packet(false, (rudp_socket_t)file, p, &head_sessions->address);
-                                                    delete p;
-                                                    head_sessions->sender->status = FIN_SENT;
-                                                }
-                                            }
-                                            head_sessions = head_sessions->next;
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                        else if(curr_session->sender->status == FIN_SENT)
-                        {
-                            /* Handle ACK for FIN */
-                            if((curr_session->sender->seqno + 1) == received_packet->header.seqno)
-                            {
-                                event_timeout_delete(timeout_callback, curr_session->sender->fin_timeout_arg);
-                                timeoutargs *t = (timeoutargs *)curr_session->sender->fin_timeout_arg;
-                                delete t->packet;
-                                delete t->recipient;
-                                delete t;
-                                curr_session->sender->session_finished = true;
-                                if(curr_socket->close_requested)
-                                {
-                                    /* See if we can close the socket */
-                                    session *head_sessions = curr_socket->sessions_list_head;
-                                    bool all_done = true;
-                                    while(head_sessions != NULL)
-                                    {
-                                        if(head_sessions->sender->session_finished == false)
-                                        {
-                                            all_done = false;
-                                        }
-                                        else if(head_sessions->receiver != NULL && head_sessions->receiver->session_finished == false)
-                                        {
-                                            all_done = false;
-                                        }
-                                        else
-                                        {
-                                            delete head_sessions->sender;
-                                            if(head_sessions->receiver)
-                                            {
-                                                delete head_sessions->receiver;
-                                            }
-                                        }
-
-                                        session *temp = head_sessions;
-                                        head_sessions = head_sessions->next;
-                                        delete temp;
-                                    }
-                                    if(all_done)
-                                    {
-                                        if(curr_socket->handler != NULL)
-                                        {
-                                            curr_socket->handler((rudp_socket_t)file, RUDP_EVENT_CLOSED, &sender);
-                                            event_fd_delete(receive_callback, (rudp_socket_t)file);
-                                            zts_close(file);
-                                            delete curr_socket;
-                                        }
-                                    }
-                                }
-                            }
-                            else
-                            {
-                                /* Received incorrect ACK for FIN - ignore it */
-                            }
-                        }
-                    }
-                    else if(rudpheader.type == RUDP_DATA)
-                    {
-                        /* Handle DATA packet. If the receiver is OPENING, it can transition to OPEN */
-                        if(curr_session->receiver->status == OPENING)
-                        {
-                            if(rudpheader.seqno == curr_session->receiver->expected_seqno)
-                            {
-                                curr_session->receiver->status = OPEN;
-                            }
-                        }
-
-                        if(rudpheader.seqno == curr_session->receiver->expected_seqno)
-                        {
-                            /* Sequence numbers match - ACK the data */
-                            uint32_t seqno = rudpheader.seqno + 1;
-                            curr_session->receiver->expected_seqno = seqno;
-                            rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, 0, NULL);
-    
-                            send_packet(true, (rudp_socket_t)file, p, &sender);
-                            delete p;
-                
-                            /* Pass the data up to the application */
-                            if(curr_socket->recv_handler != NULL)
-                                curr_socket->recv_handler((rudp_socket_t)file, &sender, 
-                                    (char*)&received_packet->payload, received_packet->payload_length);
-                        }
-                        /* Handle the case where an ACK was lost */
-                        else if(SEQ_GEQ(rudpheader.seqno, (curr_session->receiver->expected_seqno - RUDP_WINDOW)) &&
-                            SEQ_LT(rudpheader.seqno, curr_session->receiver->expected_seqno))
-                        {
-                            uint32_t seqno = rudpheader.seqno + 1;
-                            rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, 0, NULL);
-                            send_packet(true, (rudp_socket_t)file, p, &sender);
-                            delete p;
-                        }
-                    }
-                    else if(rudpheader.type == RUDP_FIN)
-                    {
-                        if(curr_session->receiver->status == OPEN)
-                        {
-                            if(rudpheader.seqno == curr_session->receiver->expected_seqno)
-                            {
-                                /* If the FIN is correct, we can ACK it */
-                                uint32_t seqno = curr_session->receiver->expected_seqno + 1;
-                                rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, 0, NULL);
-                                send_packet(true, (rudp_socket_t)file, p, &sender);
-                                delete p;
-                                curr_session->receiver->session_finished = true;
-
-                                if(curr_socket->close_requested)
-                                {
-                                    /* Can we close the socket now? */
-                                    session *head_sessions = curr_socket->sessions_list_head;
-                                    int all_done = true;
-                                    while(head_sessions != NULL)
-                                    {
-                                        if(head_sessions->sender->session_finished == false)
-                                        {
-                                            all_done = false;
-                                        }
-                                        else if(head_sessions->receiver != NULL && head_sessions->receiver->session_finished == false)
-                                        {
-                                            all_done = false;
-                                        }
-                                        else
-                                        {
-                                            delete head_sessions->sender;
-                                            if(head_sessions->receiver)
-                                            {
-                                                delete head_sessions->receiver;
-                                            }
-                                        }
-                        
-                                        session *temp = head_sessions;
-                                        head_sessions = head_sessions->next;
-                                        delete temp;
-                                    }
-                                    if(all_done)
-                                    {
-                                        if(curr_socket->handler != NULL)
-                                        {
-                                            curr_socket->handler((rudp_socket_t)file, RUDP_EVENT_CLOSED, &sender);
-                                            event_fd_delete(receive_callback, (rudp_socket_t)file);
-                                            zts_close(file);
-                                            delete curr_socket;
-                                        }
-                                    }
-                                }
-                            }
-                            else
-                            {
-                                /* FIN received with incorrect sequence number - ignore it */
-                            }
-                        }
-                    }
+                    seqno++;
                 }
+                ranges[count++].end = seqno;
             }
+            sacks->refs = 1;
+            sacks->len = count * sizeof(rudp_sack);
         }
     }
-
-    delete received_packet;
-    return 0;
+    rudp_packet *p = create_rudp_packet(RUDP_ACK, receiver->expected_seqno, sacks);
+    payload_release(sacks);
+    if(p == NULL)
+    {
+        return -1;
+    }
+    int result = send_packet(true, socket, p, &curr_session->address);
+    packet_free(p);
+    return result;
 }
 
-/* Close a RUDP socket */
-int rudp_close(rudp_socket_t rsocket)
+/*
+ * ACKs the single packet <seqno> alone, the way a version 1 sender expects:
+ * it only accepts an ACK for the oldest packet of its window.
+ */
+int ack_packet(rudp_socket_list *socket, zts_sockaddr_in6 *to, uint32_t seqno)
 {
-    rudp_socket_list *curr_socket = socket_list_head;
-    while(curr_socket->next != NULL)
-    {
-        if(curr_socket->rsock == rsocket)
-        {
-            break;
-        }
-        curr_socket = curr_socket->next;
-    }
-    if(curr_socket->rsock == rsocket)
+    rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno + 1, NULL);
+    if(p == NULL)
     {
-        curr_socket->close_requested = true;        
-        return 0;
+        return -1;
     }
-    
-    return -1;
+    int result = send_packet(true, socket, p, to);
+    packet_free(p);
+    return result;
 }
 
-/* Register receive callback function */ 
-int rudp_recvfrom_handler(
-    rudp_socket_t rsocket,
-    int (*handler)(
-        rudp_socket_t, 
-        zts_sockaddr_in6 *,
-        char *,
-        int
-    )
-)
+/*
+ * ACKs an in-order DATA packet of a receiver session according to the
+ * socket's ACK policy: once ack_every packets are waiting, or when the
+ * socket's ack_timer fires. Packets with RUDP_FLAG_PUSH in <flags>
+ * are ACKed at once.
+ */
+int delay_ack(rudp_socket_list *socket, session *curr_session, int flags)
 {
-    if(handler == NULL)
+    receiver_session *receiver = curr_session->receiver;
+    if((flags & RUDP_FLAG_PUSH) || ++receiver->ack_pending >= socket->ack_every || socket->ack_delay == 0)
     {
-        std::cerr << "rudp_recvfrom_handler failed: handler callback is null" << std::endl;
-        return -1;
+        return send_ack(socket, curr_session);
     }
-    /* Find the proper socket from the socket list */
-    rudp_socket_list *curr_socket = socket_list_head;
-    while(curr_socket->next != NULL)
+    if(socket->ack_timer == NULL)
     {
-        if(curr_socket->rsock == rsocket)
+        zts_timeval now, delay, deadline;
+        event_loop_time(socket->loop, &now);
+        delay.tv_sec = socket->ack_delay / 1000;
+        delay.tv_usec = (socket->ack_delay % 1000) * 1000;
+        timeradd(&now, &delay, &deadline);
+        socket->ack_timer = event_timeout(socket->loop, deadline, ack_timer_callback, socket, "ack_timer_callback");
+        if(socket->ack_timer == NULL)
         {
-            break;
+            std::cerr << "delay_ack: Error registering ACK timer" << std::endl;
+            return send_ack(socket, curr_session);
         }
-        curr_socket = curr_socket->next;
-    }
-    /* Extra check to handle the case where an invalid rsock is used */
-    if(curr_socket->rsock == rsocket)
-    {
-        curr_socket->recv_handler = handler;
-        return 0;
     }
-    return -1;
+    return 0;
+}
+
+/* Timer callback sending the ACKs a socket holds back */
+int ack_timer_callback(int, void *arg)
+{
+    rudp_socket_list *socket = (rudp_socket_list *)arg;
+    /* The loop releases the timer once this returns */
+    socket->ack_timer = NULL;
+    for(session *curr_session = socket->sessions_list_head; curr_session != NULL; curr_session = curr_session->next)
+    {
+        if(curr_session->receiver != NULL && curr_session->receiver->ack_pending > 0)
+        {
+            send_ack(socket, curr_session);
+        }
+    }
+    return 0;
+}
+
+/* Have the sessions of a socket sent and received their FIN? */
+bool sessions_finished(rudp_socket_list *socket)
+{
+    for(session *curr_session = socket->sessions_list_head; curr_session != NULL; curr_session = curr_session->next)
+    {
+        if((curr_session->sender != NULL && curr_session->sender->session_finished == false) ||
+            (curr_session->receiver != NULL && curr_session->receiver->session_finished == false))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Sends a FIN for each session of a closing socket that has delivered all its data */
+void send_fins(rudp_socket_list *socket)
+{
+    for(session *curr_session = socket->sessions_list_head; curr_session != NULL; curr_session = curr_session->next)
+    {
+        sender_session *sender = curr_session->sender;
+        if(sender != NULL && sender->status == OPEN && sender->data_queue == NULL && window_in_flight(sender) == 0)
+        {
+            sender->seqno += 1;
+            rudp_packet *p = create_rudp_packet(RUDP_FIN, sender->seqno, NULL);
+            send_packet(false, socket, p, &curr_session->address);
+            packet_free(p);
+            sender->status = FIN_SENT;
+        }
+    }
+}
+
+/* Frees the sessions of a socket */
+void destroy_sessions(rudp_socket_list *socket)
+{
+    while(socket->sessions_list_head != NULL)
+    {
+        session *temp = socket->sessions_list_head;
+        socket->sessions_list_head = temp->next;
+        if(temp->sender != NULL)
+        {
+            destroy_sender_session(temp->sender);
+        }
+        if(temp->receiver != NULL)
+        {
+            destroy_receiver_session(temp->receiver);
+        }
+        session_pool.destroy(temp);
+    }
+}
+
+/* Frees a sender session along with its window, which has to be empty */
+void destroy_sender_session(sender_session *sender)
+{
+    delete[] sender->window;
+    sender_session_pool.destroy(sender);
+}
+
+/* Number of DATA packets in flight */
+int window_in_flight(sender_session *sender)
+{
+    return (int)(sender->seqno + 1 - sender->window_base);
+}
+
+/* The window slot of the DATA packet <seqno>, NULL if it is not in flight */
+window_slot *window_find(sender_session *sender, uint32_t seqno)
+{
+    if(seqno - sender->window_base >= (uint32_t)window_in_flight(sender))
+    {
+        return NULL;
+    }
+    return &sender->window[seqno & (sender->window_capacity - 1)];
+}
+
+/* Limits the window to <size> packets, growing the ring if it is too small. Returns 0 on success, -1 on error */
+int window_resize(sender_session *sender, int size)
+{
+    uint32_t capacity = sender->window_capacity > 0 ? sender->window_capacity : 1;
+    while(capacity < (uint32_t)size)
+    {
+        capacity *= 2;
+    }
+    if(capacity != sender->window_capacity)
+    {
+        window_slot *window = new (std::nothrow) window_slot[capacity]();
+        if(window == NULL)
+        {
+            return -1;
+        }
+        /* The slots of the packets in flight move to their index in the larger ring */
+        for(uint32_t seqno = sender->window_base; seqno != sender->seqno + 1; seqno++)
+        {
+            window[seqno & (capacity - 1)] = sender->window[seqno & (sender->window_capacity - 1)];
+        }
+        delete[] sender->window;
+        sender->window = window;
+        sender->window_capacity = capacity;
+    }
+    sender->window_size = size;
+    return 0;
+}
+
+/* Sends queued data of an open session while its window has room */
+void window_fill(rudp_socket_list *socket, session *curr_session)
+{
+    sender_session *sender = curr_session->sender;
+    while(sender->data_queue != NULL && window_in_flight(sender) < sender->window_size)
+    {
+        /* Send packet, add to window and remove from queue */
+        sender->seqno += 1;
+        rudp_packet *datap = create_rudp_packet(RUDP_DATA, sender->seqno, sender->data_queue->payload);
+        if(datap == NULL)
+        {
+            /* The data stays queued and is sent by the next fill */
+            std::cerr << "window_fill: Error allocating DATA packet" << std::endl;
+            sender->seqno -= 1;
+            return;
+        }
+        datap->header.version = sender->peer_version;
+        window_slot *slot = window_find(sender, sender->seqno);
+        slot->packet = datap;
+        slot->retransmission_attempts = 0;
+        slot->timer = NULL;
+        slot->fast_retransmitted = false;
+        data *temp = sender->data_queue;
+        sender->data_queue = sender->data_queue->next;
+        payload_release(temp->payload);
+        data_pool.destroy(temp);
+        /* Nothing follows until this one is ACKed, so the receiver must not hold its ACK back */
+        if(sender->peer_version == RUDP_VERSION &&
+            (sender->data_queue == NULL || window_in_flight(sender) >= sender->window_size))
+        {
+            datap->flags |= RUDP_FLAG_PUSH;
+        }
+        send_packet(false, socket, datap, &curr_session->address);
+    }
+}
+
+/* Releases the packet of a window slot and its retransmission timer */
+void window_release(window_slot *slot)
+{
+    cancel_retransmission(&slot->timer);
+    if(slot->packet != NULL)
+    {
+        packet_free(slot->packet);
+        slot->packet = NULL;
+    }
+}
+
+/*
+ * Applies an ACK of <ackno> carrying <sack_count> SACK ranges to the
+ * window of an open session. The packets before <ackno> and those in the
+ * ranges have arrived and are released, but only the ACK moves the window.
+ * A packet that RUDP_SACK_THRESH SACKed packets have overtaken is
+ * retransmitted once right away instead of waiting for its timer. Returns
+ * true if the window moved.
+ */
+bool window_ack(rudp_socket_list *socket, session *curr_session, uint32_t ackno, const char *sacks, int sack_count)
+{
+    sender_session *sender = curr_session->sender;
+    bool moved = false;
+    if(SEQ_GT(ackno, sender->window_base) && SEQ_LEQ(ackno, sender->seqno + 1))
+    {
+        while(sender->window_base != ackno)
+        {
+            window_release(window_find(sender, sender->window_base));
+            sender->window_base++;
+        }
+        moved = true;
+    }
+    uint32_t highest = sender->window_base;
+    for(int i = 0; i < sack_count; i++)
+    {
+        rudp_sack sack;
+        memcpy(&sack, sacks + i * sizeof(rudp_sack), sizeof(sack));
+        if(window_find(sender, sack.start) == NULL || sack.end - sack.start > (uint32_t)window_in_flight(sender))
+        {
+            /* Stale or bogus range */
+            continue;
+        }
+        for(uint32_t seqno = sack.start; seqno != sack.end; seqno++)
+        {
+            window_slot *slot = window_find(sender, seqno);
+            if(slot == NULL)
+            {
+                break;
+            }
+            window_release(slot);
+            if(SEQ_GT(seqno, highest))
+            {
+                highest = seqno;
+            }
+        }
+    }
+    for(uint32_t seqno = sender->window_base; SEQ_LEQ(seqno + RUDP_SACK_THRESH, highest); seqno++)
+    {
+        window_slot *slot = window_find(sender, seqno);
+        if(slot->packet != NULL && !slot->fast_retransmitted)
+        {
+            slot->fast_retransmitted = true;
+            transmit_packet(socket, slot->packet, &curr_session->address);
+        }
+    }
+    return moved;
+}
+
+/* Copies <len> bytes of application data into a new payload with one reference. Returns NULL on error */
+payload_buffer *payload_alloc(const void *data, int len)
+{
+    payload_buffer *payload = payload_pool.create<payload_buffer>();
+    if(payload == NULL)
+    {
+        std::cerr << "payload_alloc: Error allocating memory for payload" << std::endl;
+        return NULL;
+    }
+    payload->refs = 1;
+    payload->len = len;
+    memcpy(payload->data(), data, len);
+    return payload;
+}
+
+/* Takes another reference to <payload>, which may be NULL */
+payload_buffer *payload_ref(payload_buffer *payload)
+{
+    if(payload != NULL)
+    {
+        payload->refs++;
+    }
+    return payload;
+}
+
+/* Drops a reference to <payload>, which may be NULL, and frees it with the last one */
+void payload_release(payload_buffer *payload)
+{
+    if(payload != NULL && --payload->refs == 0)
+    {
+        payload_pool.destroy(payload);
+    }
+}
+
+/* Allocates a RUDP packet referencing <payload> (NULL for none) and returns a pointer to it */
+rudp_packet *create_rudp_packet(uint16_t type, uint32_t seqno, payload_buffer *payload)
+{
+    rudp_hdr header;
+    header.version = RUDP_VERSION;
+    header.type = type;
+    header.seqno = seqno;
+    
+    rudp_packet *packet = packet_pool.create<rudp_packet>();
+    if(packet == NULL)
+    {
+        std::cerr << "create_rudp_packet: Error allocating memory for packet" << std::endl;
+        return NULL;
+    }
+    packet->header = header;
+    packet->flags = 0;
+    packet->payload = payload_ref(payload);
+    
+    return packet;
+}
+
+/* Frees a packet along with its reference to the payload */
+void packet_free(rudp_packet *packet)
+{
+    payload_release(packet->payload);
+    packet_pool.destroy(packet);
+}
+
+/*
+ * Describes the wire format of <p>, as given by its header version, in
+ * <datagram>. The header goes to <slot>, which also keeps a reference to the
+ * payload, the payload itself is sent from where it is.
+ */
+void encode_packet(rudp_packet *p, send_slot *slot, transport_datagram *datagram)
+{
+    static const char legacy_padding[RUDP_MAXPKTSIZE] = {0};
+    int32_t payload_length = p->payload != NULL ? p->payload->len : 0;
+    memcpy(slot->head, &p->header, sizeof(rudp_hdr));
+    if(p->flags != 0)
+    {
+        uint16_t type = p->header.type | p->flags;
+        memcpy(slot->head + offsetof(rudp_hdr, type), &type, sizeof(type));
+    }
+    slot->payload = payload_ref(p->payload);
+    datagram->iov[0].base = slot->head;
+    datagram->iov[0].len = sizeof(rudp_hdr);
+    datagram->iovcnt = 1;
+    if(p->header.version == RUDP_VERSION_LEGACY)
+    {
+        memcpy(slot->head + sizeof(rudp_hdr), &payload_length, sizeof(payload_length));
+        datagram->iov[0].len += sizeof(payload_length);
+    }
+    if(payload_length > 0)
+    {
+        datagram->iov[datagram->iovcnt].base = p->payload->data();
+        datagram->iov[datagram->iovcnt++].len = payload_length;
+    }
+    if(p->header.version == RUDP_VERSION_LEGACY)
+    {
+        /* Version 1 datagrams always carry RUDP_MAXPKTSIZE payload bytes */
+        datagram->iov[datagram->iovcnt].base = legacy_padding;
+        datagram->iov[datagram->iovcnt++].len = RUDP_MAXPKTSIZE - payload_length;
+    }
+}
+
+/*
+ * Validates a datagram of <len> bytes in <buf>, in place. The header is at
+ * the start of <buf>, <payload> is set to point into <buf>. The RUDP_FLAG_
+ * bits of a version 2 header are moved from its type to <flags>. Returns -1
+ * if it is malformed.
+ */
+int decode_packet(char *buf, int len, char **payload, int *payload_length, int *flags)
+{
+    rudp_hdr *header = (rudp_hdr *)buf;
+    if(len < (int)sizeof(rudp_hdr))
+    {
+        return -1;
+    }
+    *flags = 0;
+    if(header->version == RUDP_VERSION_LEGACY)
+    {
+        int32_t legacy_length;
+        if(len < (int)(sizeof(rudp_hdr) + sizeof(legacy_length)))
+        {
+            return -1;
+        }
+        memcpy(&legacy_length, buf + sizeof(rudp_hdr), sizeof(legacy_length));
+        if(legacy_length < 0 || legacy_length > len - (int)(sizeof(rudp_hdr) + sizeof(legacy_length)) ||
+            legacy_length > RUDP_MAXPKTSIZE)
+        {
+            return -1;
+        }
+        *payload = buf + sizeof(rudp_hdr) + sizeof(legacy_length);
+        *payload_length = legacy_length;
+        return 0;
+    }
+    if(header->version != RUDP_VERSION || len - (int)sizeof(rudp_hdr) > RUDP_MAXPKTSIZE)
+    {
+        return -1;
+    }
+    *flags = header->type & ~RUDP_TYPE_MASK;
+    header->type &= RUDP_TYPE_MASK;
+    *payload = buf + sizeof(rudp_hdr);
+    *payload_length = len - sizeof(rudp_hdr);
+    return 0;
+}
+
+/* Returns 1 if the two sockaddr_in structs are equal and 0 if not. Runs per datagram, so the addresses are compared as bytes */
+int compare_sockaddr(zts_sockaddr_in6 *s1, zts_sockaddr_in6 *s2)
+{
+    return ((s1->sin6_family == s2->sin6_family) && (memcmp(&s1->sin6_addr, &s2->sin6_addr, sizeof(s1->sin6_addr)) == 0) &&
+        (s1->sin6_port == s2->sin6_port));
+}
+
+/* Creates and returns a RUDP socket */
+rudp_socket_t rudp_socket(int port)
+{
+    if(rng_seeded == false)
+    {
+        srand(time(NULL));
+        rng_seeded = true;
+    }
+    int sockfd;
+    zts_sockaddr_in6 address;
+    const transport_t *transport;
+    {
+        std::lock_guard<std::mutex> engine_lg(engine_mut);
+        transport = engine_transport;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sin6_family = ZTS_AF_INET6;
+    int err = zts_inet_pton(ZTS_AF_INET6, "::", &address.sin6_addr);
+    if(err <= 0)
+    {
+        std::cerr << "Couldn't create zts_sockaddr_in6 from string address" << std::endl;
+        return (rudp_socket_t) -1;
+    }
+    address.sin6_port = zts_htons(port);
+
+    sockfd = transport->open(&address, false);
+    if(sockfd < 0)
+    {
+        std::cerr << "Couldn't create " << transport->name << " socket bound to port " << port << std::endl;
+        return (rudp_socket_t) -1;
+    }
+
+    rudp_socket_t socket = (rudp_socket_t)sockfd;
+
+    /* Create new socket and add to list of sockets */
+    rudp_socket_list *new_socket = new (std::nothrow) rudp_socket_list;
+    if(new_socket == NULL)
+    {
+        std::cerr << "rudp_socket: Error allocating memory for socket list" << std::endl;
+        return (rudp_socket_t) -1;
+    }
+    new_socket->rsock = socket;
+    new_socket->close_requested = false;
+    new_socket->sessions_list_head = NULL;
+    new_socket->handler = NULL;
+    new_socket->recv_handler = NULL;
+    new_socket->timer_slack = RUDP_TIMER_SLACK;
+    new_socket->window = RUDP_WINDOW;
+    new_socket->ack_every = RUDP_ACK_EVERY;
+    new_socket->ack_delay = RUDP_ACK_DELAY;
+    new_socket->ack_timer = NULL;
+    new_socket->transport = transport;
+    int i;
+    for(i = 0; i < RUDP_RECV_BATCH; i++)
+    {
+        new_socket->recv_batch[i].buf = new_socket->recv_buffers[i];
+        new_socket->recv_batch[i].size = sizeof(new_socket->recv_buffers[i]);
+    }
+    new_socket->send_count = 0;
+    new_socket->flush_deferred = false;
+    new_socket->refs.store(1, std::memory_order_relaxed);
+    new_socket->destroyed = false;
+
+    /* Spread the sockets over the engine's loops, without an engine they all share the default loop */
+    std::unique_lock<std::mutex> engine_ul(engine_mut);
+    if(engine_loops.empty())
+    {
+        new_socket->loop = event_loop_default();
+    }
+    else
+    {
+        new_socket->loop = engine_loops[engine_next_loop++ % engine_loops.size()];
+    }
+    engine_ul.unlock();
+
+    std::unique_lock<std::shared_mutex> socket_map_ul(socket_map_mut);
+    socket_map[socket] = new_socket;
+    socket_map_ul.unlock();
+
+    /* Register callback event for this socket descriptor */
+    if(event_fd(new_socket->loop, sockfd, receive_callback, new_socket, "receive_callback") < 0)
+    {
+        std::cerr << "Error registering receive callback function" << std::endl;
+    }
+
+    return socket;
+}
+
+/* Callback function executed when something is received on fd: handles the datagrams waiting on it, up to RUDP_RECV_BATCH */
+int receive_callback(int file, void *arg)
+{
+    /* The socket was registered as the callback argument */
+    rudp_socket_list *curr_socket = (rudp_socket_list *)arg;
+    if(curr_socket == NULL)
+    {
+        std::cerr << "Error: attempt to receive on invalid socket" << std::endl;
+        return -1;
+    }
+
+    int received = curr_socket->transport->recv_batch(file, curr_socket->recv_batch, RUDP_RECV_BATCH);
+    int i;
+    for(i = 0; i < received; i++)
+    {
+        transport_datagram *datagram = &curr_socket->recv_batch[i];
+        char *payload;
+        int payload_length, flags;
+        if(decode_packet((char *)datagram->buf, datagram->len, &payload, &payload_length, &flags) < 0)
+        {
+            /* Not a RUDP packet of a version we understand */
+            continue;
+        }
+        int result = receive_packet(curr_socket, file, (const rudp_hdr *)datagram->buf, flags, payload, payload_length, &datagram->addr);
+        if(result < 0)
+        {
+            return -1;
+        }
+        if(result > 0)
+        {
+            /* The socket was closed and freed along with the rest of the batch */
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Handles one received packet, still in the receive buffer: <header> is at
+ * its start and <received_payload> points behind it. Returns 1 if the socket was
+ * closed and freed, -1 on error.
+ */
+int receive_packet(rudp_socket_list *curr_socket, int file, const rudp_hdr *header, int flags, char *received_payload, int received_length, zts_sockaddr_in6 *sender)
+{
+#ifdef DEBUG
+    char type[5];
+    short t = header->type;
+    if(t == 1)
+        strcpy(type, "DATA");
+    else if(t == 2)
+        strcpy(type, "ACK");
+    else if(t == 4)
+        strcpy(type, "SYN");
+    else if(t==5)
+        strcpy(type, "FIN");
+    else
+        strcpy(type, "BAD");
+
+    char sender_str[ZTS_INET6_ADDRSTRLEN];
+    const char *err = zts_inet_ntop(ZTS_AF_INET6, &sender->sin6_addr, sender_str, ZTS_INET6_ADDRSTRLEN);
+    if(err != NULL)
+    {
+        printf("Received %s packet from %s:%d seq number=%u on socket=%d\n",type, sender_str, zts_ntohs(sender->sin6_port), header->seqno, file);
+    }
+#endif /* DEBUG */
+
+    if(curr_socket->rsock == (rudp_socket_t)file)
+    {
+        /* We found the correct socket, now see if a session already exists for this peer */
+        if(curr_socket->sessions_list_head == NULL)
+        {
+            /* The list is empty, so we check if the sender has initiated the protocol properly (by sending a SYN) */
+            if(header->type == RUDP_SYN)
+            {
+                /* SYN Received. Create a new session at the head of the list */
+                uint32_t seqno = header->seqno + 1;
+                if(create_receiver_session(curr_socket, seqno, header->version, sender) < 0)
+                {
+                    /* No session to ACK for, the sender retransmits its SYN */
+                    return -1;
+                }
+                /* Respond with an ACK */
+                rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, NULL);
+                send_packet(true, curr_socket, p, sender);
+                packet_free(p);
+            }
+            else
+            {
+                /* No sessions exist and we got a non-SYN, so ignore it */
+            }
+        }
+        else
+        {
+            /* Some sessions exist to be checked */
+            bool session_found = false;
+            session *curr_session = curr_socket->sessions_list_head;
+            session *last_session;
+            while(curr_session != NULL)
+            {
+                if(curr_session->next == NULL)
+                {
+                    last_session = curr_session;
+                }
+                if(compare_sockaddr(&curr_session->address, sender) == 1)
+                {
+                    /* Found an existing session */
+                    session_found = true;
+                    break;
+                }
+
+                curr_session = curr_session->next;
+            }
+            if(session_found == false)
+            {
+                /* No session was found for this peer */
+                if(header->type == RUDP_SYN)
+                {
+                    /* SYN Received. Send an ACK and create a new session */
+                    uint32_t seqno = header->seqno + 1;
+                    if(create_receiver_session(curr_socket, seqno, header->version, sender) < 0)
+                    {
+                        return -1;
+                    }
+                    rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, NULL);
+                    send_packet(true, curr_socket, p, sender);
+                    packet_free(p);
+                }
+                else
+                {
+                    /* Session does not exist and non-SYN received - ignore it */
+                }
+            }
+            else
+            {
+            /* We found a matching session */ 
+                if(header->type == RUDP_SYN)
+                {
+                    if(curr_session->receiver == NULL || curr_session->receiver->status == OPENING)
+                    {
+                        /* Create a new receiver session and ACK the SYN*/
+                        receiver_session *new_receiver_session = receiver_session_pool.create<receiver_session>();
+                        if(new_receiver_session == NULL)
+                        {
+                            std::cerr << "receive_callback: Error allocating receiver session" << std::endl;
+                            return -1;
+                        }
+                        init_receiver_session(new_receiver_session, header->seqno + 1, header->version);
+                        /* A retransmitted SYN replaces the session it opened, along with what that buffered */
+                        if(curr_session->receiver != NULL)
+                        {
+                            destroy_receiver_session(curr_session->receiver);
+                        }
+                        curr_session->receiver = new_receiver_session;
+
+                        int32_t seqno = curr_session->receiver->expected_seqno;
+                        rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, NULL);
+                        send_packet(true, curr_socket, p, sender);
+                        packet_free(p);
+                    }
+                    else
+                    {
+                        /* Received a SYN when there is already an active receiver session, so we ignore it */
+                    }
+                }
+                if(header->type == RUDP_ACK)
+                {
+                    uint32_t ack_sqn = header->seqno;
+                    if(curr_session->sender->status == SYN_SENT)
+                    {
+                        /* This an ACK for a SYN */
+                        uint32_t syn_sqn = curr_session->sender->seqno;
+                        if((ack_sqn - 1) == syn_sqn)
+                        {
+                            /* Delete the retransmission timeout */
+                            cancel_retransmission(&curr_session->sender->syn_timer);
+                            curr_session->sender->status = OPEN;
+                            /* Version 1 peers ACK in their own format and need DATA in it too */
+                            if(header->version == RUDP_VERSION_LEGACY)
+                            {
+                                curr_session->sender->peer_version = RUDP_VERSION_LEGACY;
+                            }
+                            window_fill(curr_socket, curr_session);
+                        }
+                    }
+                    else if(curr_session->sender->status == OPEN)
+                    {
+                        /* This is an ACK for DATA, everything before its sequence number has arrived */
+                        int sack_count = received_length / (int)sizeof(rudp_sack);
+                        if(window_ack(curr_socket, curr_session, ack_sqn, received_payload, sack_count))
+                        {
+                            window_fill(curr_socket, curr_session);
+                            if(curr_socket->close_requested)
+                            {
+                                send_fins(curr_socket);
+                            }
+                        }
+                    }
+                    else if(curr_session->sender->status == FIN_SENT)
+                    {
+                        /* Handle ACK for FIN */
+                        if((curr_session->sender->seqno + 1) == header->seqno)
+                        {
+                            cancel_retransmission(&curr_session->sender->fin_timer);
+                            curr_session->sender->session_finished = true;
+                            if(curr_socket->close_requested && sessions_finished(curr_socket))
+                            {
+                                destroy_sessions(curr_socket);
+                                if(curr_socket->handler != NULL)
+                                {
+                                    curr_socket->handler((rudp_socket_t)file, RUDP_EVENT_CLOSED, sender);
+                                    destroy_socket(curr_socket);
+                                    return 1;
+                                }
+                            }
+                        }
+                        else
+                        {
+                            /* Received incorrect ACK for FIN - ignore it */
+                        }
+                    }
+                }
+                else if(header->type == RUDP_DATA)
+                {
+                    /* Handle DATA packet. If the receiver is OPENING, it can transition to OPEN */
+                    if(curr_session->receiver->status == OPENING)
+                    {
+                        if(header->seqno == curr_session->receiver->expected_seqno)
+                        {
+                            curr_session->receiver->status = OPEN;
+                        }
+                    }
+
+                    receiver_session *receiver = curr_session->receiver;
+                    if(header->seqno == receiver->expected_seqno)
+                    {
+                        /* Sequence numbers match - pass the data up, followed by the run buffered behind it */
+                        receiver->expected_seqno++;
+                        if(curr_socket->recv_handler != NULL)
+                        {
+                            COPY_STATS_ADD(RECEIVE_DELIVERED, received_length);
+                            curr_socket->recv_handler((rudp_socket_t)file, sender, received_payload, received_length);
+                        }
+                        /* A version 1 sender gets an ACK for each packet delivered, in order */
+                        bool legacy = receiver->peer_version != RUDP_VERSION;
+                        if(legacy)
+                        {
+                            ack_packet(curr_socket, sender, header->seqno);
+                        }
+                        payload_buffer *buffered;
+                        bool gap_filled = false;
+                        while((buffered = reorder_take(receiver, receiver->expected_seqno)) != NULL)
+                        {
+                            gap_filled = true;
+                            uint32_t seqno = receiver->expected_seqno++;
+                            if(curr_socket->recv_handler != NULL)
+                            {
+                                COPY_STATS_ADD(RECEIVE_DELIVERED, buffered->len);
+                                curr_socket->recv_handler((rudp_socket_t)file, sender, buffered->data(), buffered->len);
+                            }
+                            payload_release(buffered);
+                            if(legacy)
+                            {
+                                ack_packet(curr_socket, sender, seqno);
+                            }
+                        }
+                        /* Gaps are reported at once, the sender is waiting to retransmit or move its window */
+                        if(!legacy && (gap_filled || receiver->reorder_count > 0))
+                        {
+                            send_ack(curr_socket, curr_session);
+                        }
+                        else if(!legacy)
+                        {
+                            delay_ack(curr_socket, curr_session, flags);
+                        }
+                    }
+                    /* Ahead of a gap: keep it and tell a version 2 sender which packets are missing */
+                    else if(SEQ_GT(header->seqno, receiver->expected_seqno) &&
+                        reorder_insert(receiver, header->seqno, received_payload, received_length) == 0)
+                    {
+                        if(receiver->peer_version == RUDP_VERSION)
+                        {
+                            send_ack(curr_socket, curr_session);
+                        }
+                        else
+                        {
+                            ack_packet(curr_socket, sender, header->seqno);
+                        }
+                    }
+                    /* Handle the case where an ACK was lost */
+                    else if(SEQ_GEQ(header->seqno, (receiver->expected_seqno - RUDP_WINDOW_MAX)) &&
+                        SEQ_LT(header->seqno, receiver->expected_seqno))
+                    {
+                        if(receiver->peer_version == RUDP_VERSION)
+                        {
+                            send_ack(curr_socket, curr_session);
+                        }
+                        else
+                        {
+                            /* Version 1 senders only accept an ACK for the packet they sent */
+                            ack_packet(curr_socket, sender, header->seqno);
+                        }
+                    }
+                }
+                else if(header->type == RUDP_FIN)
+                {
+                    if(curr_session->receiver->status == OPEN)
+                    {
+                        if(header->seqno == curr_session->receiver->expected_seqno)
+                        {
+                            /* If the FIN is correct, we can ACK it */
+                            uint32_t seqno = curr_session->receiver->expected_seqno + 1;
+                            rudp_packet *p = create_rudp_packet(RUDP_ACK, seqno, NULL);
+                            send_packet(true, curr_socket, p, sender);
+                            packet_free(p);
+                            curr_session->receiver->session_finished = true;
+
+                            if(curr_socket->close_requested && sessions_finished(curr_socket))
+                            {
+                                destroy_sessions(curr_socket);
+                                if(curr_socket->handler != NULL)
+                                {
+                                    curr_socket->handler((rudp_socket_t)file, RUDP_EVENT_CLOSED, sender);
+                                    destroy_socket(curr_socket);
+                                    return 1;
+                                }
+                            }
+                        }
+                        else
+                        {
+                            /* FIN received with incorrect sequence number - ignore it */
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Close a RUDP socket */
+int rudp_close(rudp_socket_t rsocket)
+{
+    socket_command *cmd = create_command(socket_command::CLOSE, rsocket);
+    if(cmd == NULL)
+    {
+        return -1;
+    }
+    return submit_command(cmd);
+}
+
+/* Register receive callback function */ 
+int rudp_recvfrom_handler(
+    rudp_socket_t rsocket,
+    int (*handler)(
+        rudp_socket_t, 
+        zts_sockaddr_in6 *,
+        char *,
+        int
+    )
+)
+{
+    if(handler == NULL)
+    {
+        std::cerr << "rudp_recvfrom_handler failed: handler callback is null" << std::endl;
+        return -1;
+    }
+    socket_command *cmd = create_command(socket_command::RECV_HANDLER, rsocket);
+    if(cmd == NULL)
+    {
+        return -1;
+    }
+    cmd->recv_handler = handler;
+    return submit_command(cmd);
 }
 
 /* Register event handler callback function with a RUDP socket */
@@ -822,26 +1408,69 @@ int rudp_event_handler(
         return -1;
     }
 
-    /* Find the proper socket from the socket list */
-    rudp_socket_list *curr_socket = socket_list_head;
-    while(curr_socket->next != NULL)
+    socket_command *cmd = create_command(socket_command::EVENT_HANDLER, rsocket);
+    if(cmd == NULL)
     {
-        if(curr_socket->rsock == rsocket)
-        {
-            break;
-        }
-        curr_socket = curr_socket->next;
+        return -1;
     }
+    cmd->handler = handler;
+    return submit_command(cmd);
+}
 
-    /* Extra check to handle the case where an invalid rsock is used */
-    if(curr_socket->rsock == rsocket)
+/* Sets the slack of a socket's retransmission timers */
+int rudp_timer_slack(rudp_socket_t rsocket, int slack_ms)
+{
+    if(slack_ms < 0)
     {
-        curr_socket->handler = handler;
-        return 0;
+        std::cerr << "rudp_timer_slack failed: negative slack" << std::endl;
+        return -1;
     }
-    return -1;
+
+    socket_command *cmd = create_command(socket_command::TIMER_SLACK, rsocket);
+    if(cmd == NULL)
+    {
+        return -1;
+    }
+    cmd->timer_slack = slack_ms;
+    return submit_command(cmd);
 }
 
+/* Sets the window of a socket's sessions */
+int rudp_window(rudp_socket_t rsocket, int packets)
+{
+    if(packets < 1 || packets > RUDP_WINDOW_MAX)
+    {
+        std::cerr << "rudp_window failed: window out of range" << std::endl;
+        return -1;
+    }
+
+    socket_command *cmd = create_command(socket_command::WINDOW, rsocket);
+    if(cmd == NULL)
+    {
+        return -1;
+    }
+    cmd->window = packets;
+    return submit_command(cmd);
+}
+
+/* Sets the ACK policy of a socket's receiving sessions */
+int rudp_delayed_ack(rudp_socket_t rsocket, int packets, int delay_ms)
+{
+    if(packets < 1 || delay_ms < 0 || delay_ms >= RUDP_TIMEOUT)
+    {
+        std::cerr << "rudp_delayed_ack failed: policy out of range" << std::endl;
+        return -1;
+    }
+
+    socket_command *cmd = create_command(socket_command::DELAYED_ACK, rsocket);
+    if(cmd == NULL)
+    {
+        return -1;
+    }
+    cmd->ack_every = packets;
+    cmd->ack_delay = delay_ms;
+    return submit_command(cmd);
+}
 
 /* Sends a block of data to the receiver. Returns 0 on success, -1 on error */
 int rudp_sendto(rudp_socket_t rsocket, void* data, int len, zts_sockaddr_in6 *to)
@@ -864,142 +1493,116 @@ int rudp_sendto(rudp_socket_t rsocket, void* data, int len, zts_sockaddr_in6 *to
         return -1;
     }
 
+    socket_command *cmd = create_command(socket_command::SENDTO, rsocket);
+    if(cmd == NULL)
+    {
+        return -1;
+    }
+    /* The only copy of the data the engine makes */
+    cmd->payload = payload_alloc(data, len);
+    if(cmd->payload == NULL)
+    {
+        command_pool.destroy(cmd);
+        return -1;
+    }
+    COPY_STATS_ADD(SEND_ACCEPTED, len);
+    COPY_STATS_ADD(SEND_COPIED, len);
+    cmd->to = *to;
+    return submit_command(cmd);
+}
+
+/* Queues a block of data for the receiver, on the socket's event loop. Takes its own reference to <payload>. Returns 0 on success, -1 on error */
+int socket_sendto(rudp_socket_list *curr_socket, payload_buffer *payload, zts_sockaddr_in6 *to)
+{
     bool new_session_created = true;
     uint32_t seqno = 0;
-    if(socket_list_head == NULL)
+    if(curr_socket->destroyed)
     {
-        std::cerr << "Error: attempt to send on invalid socket. No sockets in the list" << std::endl;
+        std::cerr << "Error: attempt to send on invalid socket. Socket closed" << std::endl;
         return -1;
     }
     else
     {
-        /* Find the correct socket in our list */
-        rudp_socket_list *curr_socket = socket_list_head;
-        while(curr_socket != NULL)
+        /* We found the correct socket, now see if a session already exists for this peer */
+        struct data *data_item = data_pool.create<struct data>();
+        if(data_item == NULL)
         {
-            if(curr_socket->rsock == rsocket)
-            {
-                break;
-            }
-            curr_socket = curr_socket->next;
+            std::cerr << "rudp_sendto: Error allocating data queue" << std::endl;
+            return -1;
+        }  
+        data_item->payload = payload_ref(payload);
+        data_item->next = NULL;
+
+        if(curr_socket->sessions_list_head == NULL)
+        {
+            /* The list is empty, so we create a new sender session at the head of the list */
+            seqno = rand();
+            create_sender_session(curr_socket, seqno, to, &data_item);
         }
-        if(curr_socket->rsock == rsocket)
+        else
         {
-            /* We found the correct socket, now see if a session already exists for this peer */
-            struct data *data_item = new (std::nothrow) struct data;
-            if(data_item == NULL)
-            {
-                std::cerr << "rudp_sendto: Error allocating data queue" << std::endl;
-                return -1;
-            }  
-            data_item->item = new (std::nothrow) char[len];
-            if(data_item->item == NULL)
-            {
-                std::cerr << "rudp_sendto: Error allocating data queue item" << std::endl;
-                return -1;
-            }
-            memcpy(data_item->item, data, len);
-            data_item->len = len;
-            data_item->next = NULL;
-
-            if(curr_socket->sessions_list_head == NULL)
-            {
-                /* The list is empty, so we create a new sender session at the head of the list */
-                seqno = rand();
-                create_sender_session(curr_socket, seqno, to, &data_item);
-            }
-            else
+            bool session_found = false;
+            session *curr_session = curr_socket->sessions_list_head;
+            session *last_in_list;
+            while(curr_session != NULL)
             {
-                bool session_found = false;
-                session *curr_session = curr_socket->sessions_list_head;
-                session *last_in_list;
-                while(curr_session != NULL)
+                if(compare_sockaddr(&curr_session->address, to) == 1)
                 {
-                    if(compare_sockaddr(&curr_session->address, to) == 1)
+                    if(curr_session->sender==NULL)
                     {
-                        bool data_is_queued = false;
-                        bool we_must_queue = true;
-
-                        if(curr_session->sender==NULL)
-                        {
-                            seqno = rand();
-                            create_sender_session(curr_socket, seqno, to, &data_item);
-                            rudp_packet *p = create_rudp_packet(RUDP_SYN, seqno, 0, NULL);            
-                            send_packet(false, rsocket, p, to);
-                            delete p;
-                            new_session_created = false ; /* Dont send the SYN twice */
-                            break;
-                        }
-
-                        if(curr_session->sender->data_queue != NULL)
-                            data_is_queued = true;
-
-                        if(curr_session->sender->status == OPEN && !data_is_queued)
-                        {
-                            int i;
-                            for(i = 0; i < RUDP_WINDOW; i++)
-                            {
-                                if(curr_session->sender->sliding_window[i] == NULL)
-                                {
-                                    curr_session->sender->seqno = curr_session->sender->seqno + 1;
-                                    rudp_packet *datap = create_rudp_packet(RUDP_DATA, curr_session->sender->seqno, len, (char *)data);
-                                    curr_session->sender->sliding_window[i] = datap;
-                                    curr_session->sender->retransmission_attempts[i] = 0;
-                                    send_packet(false, rsocket, datap, to);
-                                    we_must_queue = false;
-                                    break;
-                                }
-                            }
-                        }
+                        seqno = rand();
+                        create_sender_session(curr_socket, seqno, to, &data_item);
+                        rudp_packet *p = create_rudp_packet(RUDP_SYN, seqno, NULL);            
+                        send_packet(false, curr_socket, p, to);
+                        packet_free(p);
+                        new_session_created = false ; /* Dont send the SYN twice */
+                        break;
+                    }
 
-                        if(we_must_queue == true)
+                    /* Queue the data, an open session sends it right away if the window has room */
+                    if(curr_session->sender->data_queue == NULL)
+                    {
+                        /* First entry in the data queue */
+                        curr_session->sender->data_queue = data_item;
+                    }
+                    else
+                    {
+                        /* Add to end of data queue */
+                        struct data *tail = curr_session->sender->data_queue;
+                        while(tail->next != NULL)
                         {
-                            if(curr_session->sender->data_queue == NULL)
-                            {
-                                /* First entry in the data queue */
-                                curr_session->sender->data_queue = data_item;
-                            }
-                            else
-                            {
-                                /* Add to end of data queue */
-                                struct data *curr_socket = curr_session->sender->data_queue;
-                                while(curr_socket->next != NULL)
-                                {
-                                    curr_socket = curr_socket->next;
-                                }
-                                curr_socket->next = data_item;
-                            }
+                            tail = tail->next;
                         }
-
-                        session_found = true;
-                        new_session_created = false;
-                        break;
+                        tail->next = data_item;
+                    }
+                    if(curr_session->sender->status == OPEN)
+                    {
+                        window_fill(curr_socket, curr_session);
                     }
-                    if(curr_session->next==NULL)
-                        last_in_list=curr_session;
 
-                    curr_session = curr_session->next;
-                }
-                if(!session_found)
-                {
-                    /* If not, create a new session */
-                    seqno = rand();
-                    create_sender_session(curr_socket, seqno, to, &data_item);
+                    session_found = true;
+                    new_session_created = false;
+                    break;
                 }
+                if(curr_session->next==NULL)
+                    last_in_list=curr_session;
+
+                curr_session = curr_session->next;
+            }
+            if(!session_found)
+            {
+                /* If not, create a new session */
+                seqno = rand();
+                create_sender_session(curr_socket, seqno, to, &data_item);
             }
-        }
-        else
-        {
-            std::cerr << "Error: attempt to send on invalid socket. Socket not found" << std::endl;
-            return -1;
         }
     }
     if(new_session_created == true)
     {
         /* Send the SYN for the new session */
-        rudp_packet *p = create_rudp_packet(RUDP_SYN, seqno, 0, NULL);    
-        send_packet(false, rsocket, p, to);
-        delete p;
+        rudp_packet *p = create_rudp_packet(RUDP_SYN, seqno, NULL);    
+        send_packet(false, curr_socket, p, to);
+        packet_free(p);
     }
     return 0;
 }
@@ -1008,23 +1611,15 @@ int rudp_sendto(rudp_socket_t rsocket, void* data, int len, zts_sockaddr_in6 *to
 int timeout_callback(int fd, void *args)
 {
     timeoutargs *timeargs=(timeoutargs *)args;
-    rudp_socket_list *curr_socket = socket_list_head;
-    while(curr_socket != NULL)
-    {
-        if(curr_socket->rsock == timeargs->fd)
-        {
-            break;
-        }
-        curr_socket = curr_socket->next;
-    }
-    if(curr_socket->rsock == timeargs->fd)
+    rudp_socket_list *curr_socket = timeargs->socket;
+    if(curr_socket != NULL)
     {
         bool session_found = false;
         /* Check if we already have a session for this peer */
         session *curr_session = curr_socket->sessions_list_head;
         while(curr_session != NULL)
         {
-            if(compare_sockaddr(&curr_session->address, timeargs->recipient) == 1)
+            if(compare_sockaddr(&curr_session->address, &timeargs->recipient) == 1)
             {
                 /* Found an existing session */
                 session_found = true;
@@ -1034,71 +1629,92 @@ int timeout_callback(int fd, void *args)
         }
         if(session_found == true)
         {
+            /* Find the timer handle and retransmission counter of the packet */
+            event_timer_t *timer = NULL;
+            int *attempts = NULL;
             if(timeargs->packet->header.type == RUDP_SYN)
             {
-                if(curr_session->sender->syn_retransmit_attempts >= RUDP_MAXRETRANS)
-                {
-                    curr_socket->handler(timeargs->fd, RUDP_EVENT_TIMEOUT, timeargs->recipient);
-                }
-                else
-                {
-                    curr_session->sender->syn_retransmit_attempts++;
-                    send_packet(false, timeargs->fd, timeargs->packet, timeargs->recipient);
-                    delete timeargs->packet;
-                    timeargs->packet = nullptr;
-                }
+                timer = &curr_session->sender->syn_timer;
+                attempts = &curr_session->sender->syn_retransmit_attempts;
             }
             else if(timeargs->packet->header.type == RUDP_FIN)
             {
-                if(curr_session->sender->fin_retransmit_attempts >= RUDP_MAXRETRANS)
-                {
-                    curr_socket->handler(timeargs->fd, RUDP_EVENT_TIMEOUT, timeargs->recipient);
-                }
-                else
-                {
-                    curr_session->sender->fin_retransmit_attempts++;
-                    send_packet(false, timeargs->fd, timeargs->packet, timeargs->recipient);
-                    delete timeargs->packet;
-                    timeargs->packet = nullptr;
-                }
+                timer = &curr_session->sender->fin_timer;
+                attempts = &curr_session->sender->fin_retransmit_attempts;
             }
             else
             {
-                int i;
-                int index;
-                for(i = 0; i < RUDP_WINDOW; i++)
+                window_slot *slot = window_find(curr_session->sender, timeargs->packet->header.seqno);
+                if(slot != NULL)
                 {
-                    if(curr_session->sender->sliding_window[i] != NULL && 
-                        curr_session->sender->sliding_window[i]->header.seqno == timeargs->packet->header.seqno)
-                    {
-                        index = i;
-                    }
+                    timer = &slot->timer;
+                    attempts = &slot->retransmission_attempts;
                 }
+            }
 
-                if(curr_session->sender->retransmission_attempts[index] >= RUDP_MAXRETRANS)
+            if(timer != NULL && event_timer_arg(*timer) == timeargs)
+            {
+                if(*attempts >= RUDP_MAXRETRANS)
                 {
-                    curr_socket->handler(timeargs->fd, RUDP_EVENT_TIMEOUT, timeargs->recipient);
+                    curr_socket->handler(timeargs->fd, RUDP_EVENT_TIMEOUT, &timeargs->recipient);
                 }
                 else
                 {
-                    curr_session->sender->retransmission_attempts[index]++;
-                    send_packet(false, timeargs->fd, timeargs->packet, timeargs->recipient);
-                    delete timeargs->packet;
-                    timeargs->packet = nullptr;
+                    /* Retransmit and re-arm the same timer, it keeps owning timeargs */
+                    (*attempts)++;
+                    transmit_packet(curr_socket, timeargs->packet, &timeargs->recipient);
+                    event_timer_reschedule(*timer, retransmission_deadline(curr_socket->loop));
+                    return 0;
                 }
+                /* The timer is released when we return, so forget its handle */
+                *timer = NULL;
             }
         }
     }
 
-    delete timeargs->packet;
-    delete timeargs->recipient;
-    delete timeargs;
+    packet_free(timeargs->packet);
+
+    timeoutargs_pool.destroy(timeargs);
     return 0;
 }
 
-/* Transmit a packet via UDP */
-int send_packet(bool is_ack, rudp_socket_t rsocket, rudp_packet *p, zts_sockaddr_in6 *recipient)
+/* Cancels a retransmission timer and releases its arguments */
+void cancel_retransmission(event_timer_t *timer)
+{
+    timeoutargs *args = (timeoutargs *)event_timer_arg(*timer);
+    if(args == NULL)
+    {
+        return;
+    }
+    event_timer_cancel(*timer);
+    *timer = NULL;
+    packet_free(args->packet);
+    timeoutargs_pool.destroy(args);
+}
+
+/* Absolute time at which a packet sent now has to be retransmitted, on the clock of <loop> */
+zts_timeval retransmission_deadline(event_loop_t *loop)
+{
+    zts_timeval currentTime;
+    event_loop_time(loop, &currentTime);
+    zts_timeval delay;
+    delay.tv_sec = RUDP_TIMEOUT/1000;
+    delay.tv_usec= 0;
+    zts_timeval timeout_time;
+    timeradd(&currentTime, &delay, &timeout_time);
+
+    return timeout_time;
+}
+
+/*
+ * Hands a packet to the UDP socket. On the socket's loop thread the packet is
+ * queued and sent along with the others of the same loop iteration by
+ * flush_packets(), elsewhere it is sent right away. Returns 0 on success, -1
+ * on error.
+ */
+int transmit_packet(rudp_socket_list *socket, rudp_packet *p, zts_sockaddr_in6 *recipient)
 {
+#ifdef DEBUG
     char type[5];
     short t=p->header.type;
     if(t == 1)
@@ -1120,71 +1736,147 @@ int send_packet(bool is_ack, rudp_socket_t rsocket, rudp_packet *p, zts_sockaddr
         return -1;
     }
     std::cout << "Sending " << type << "packet to " << recipient_str << ':' << zts_ntohs(recipient->sin6_port)
-        << " seq number=" << p->header.seqno << " on socket=" << rsocket << std::endl;
+        << " seq number=" << p->header.seqno << " on socket=" << socket->rsock << std::endl;
+#endif /* DEBUG */
 
-    if (DROP != 0 && rand() % DROP == 1)
+    if(event_loop_current() == socket->loop)
     {
-        std::cout << "Dropped" << std::endl;
+        if(!socket->flush_deferred)
+        {
+            if(event_defer(socket->loop, flush_callback, socket) < 0)
+            {
+                std::cerr << "transmit_packet: Error deferring the flush" << std::endl;
+                return -1;
+            }
+            socket->flush_deferred = true;
+        }
+        if(socket->send_count == RUDP_SEND_BATCH && flush_packets(socket) < 0)
+        {
+            return -1;
+        }
+        transport_datagram *datagram = &socket->send_batch[socket->send_count];
+        encode_packet(p, &socket->send_slots[socket->send_count++], datagram);
+        datagram->addr = *recipient;
     }
     else
     {
-        if (zts_sendto(static_cast<int>((uint64_t)rsocket), p, sizeof(rudp_packet), 0, (zts_sockaddr *)recipient, sizeof(zts_sockaddr_in6)) < 0)
+        send_slot slot;
+        transport_datagram datagram;
+        encode_packet(p, &slot, &datagram);
+        datagram.addr = *recipient;
+        int sent = socket->transport->send_batch(static_cast<int>((uint64_t)socket->rsock), &datagram, 1);
+        payload_release(slot.payload);
+        if (sent < 0)
         {
             std::cerr << "rudp_sendto: sendto failed" << std::endl;
             return -1;
         }
     }
 
+    return 0;
+}
+
+/* Sends the packets queued by transmit_packet() in as few calls as the transport allows. Returns 0 on success, -1 if any failed */
+int flush_packets(rudp_socket_list *socket)
+{
+    int sent = 0;
+    int result = 0;
+    while(sent < socket->send_count)
+    {
+        int n = socket->transport->send_batch(static_cast<int>((uint64_t)socket->rsock), &socket->send_batch[sent], socket->send_count - sent);
+        if(n < 0)
+        {
+            /* Skip the datagram that failed, like a failed sendto */
+            std::cerr << "rudp_sendto: sendto failed" << std::endl;
+            result = -1;
+            n = 1;
+        }
+        sent += n;
+    }
+    for(int i = 0; i < socket->send_count; i++)
+    {
+        payload_release(socket->send_slots[i].payload);
+    }
+    socket->send_count = 0;
+    return result;
+}
+
+/* Deferred to the end of every loop iteration a socket has queued packets in */
+int flush_callback(int, void *arg)
+{
+    rudp_socket_list *socket = (rudp_socket_list *)arg;
+    socket->flush_deferred = false;
+    /* Errors are already reported, they must not stop the loop */
+    flush_packets(socket);
+    return 0;
+}
+
+/*
+ * Closes a socket whose sessions were all done when the close was requested.
+ * Deferred, so that no callback still working on the socket sees it freed.
+ */
+int close_callback(int, void *arg)
+{
+    rudp_socket_list *socket = (rudp_socket_list *)arg;
+    if(sessions_finished(socket))
+    {
+        destroy_sessions(socket);
+        if(socket->handler != NULL)
+        {
+            socket->handler(socket->rsock, RUDP_EVENT_CLOSED, NULL);
+            destroy_socket(socket);
+        }
+    }
+    return 0;
+}
+
+/* Transmit a packet via UDP and arm its retransmission timer unless it is an ACK */
+int send_packet(bool is_ack, rudp_socket_list *socket, rudp_packet *p, zts_sockaddr_in6 *recipient)
+{
+    if(transmit_packet(socket, p, recipient) < 0)
+    {
+        return -1;
+    }
+
     if(!is_ack)
     {
         /* Set a timeout event if the packet isn't an ACK */
-        timeoutargs *timeargs = new (std::nothrow) timeoutargs;
+        timeoutargs *timeargs = timeoutargs_pool.create<timeoutargs>();
         if(timeargs == NULL)
         {
             std::cerr << "send_packet: Error allocating timeout args" << std::endl;
             return -1;
         }
-        timeargs->packet = new (std::nothrow) rudp_packet;
+        /* A packet of its own, the payload is shared */
+        timeargs->packet = create_rudp_packet(p->header.type, p->header.seqno, p->payload);
         if(timeargs->packet == NULL)
         {
             std::cerr << "send_packet: Error allocating timeout args packet" << std::endl;
+            timeoutargs_pool.destroy(timeargs);
             return -1;
         }
-        timeargs->recipient = new (std::nothrow) zts_sockaddr_in6;
-        if(timeargs->packet == NULL)
+        timeargs->fd = socket->rsock;
+        timeargs->socket = socket;
+        timeargs->packet->header = p->header;
+        timeargs->packet->flags = p->flags;
+        timeargs->recipient = *recipient;  
+
+        event_timer_t timer = event_timeout_slack(socket->loop, retransmission_deadline(socket->loop), socket->timer_slack, timeout_callback, timeargs, "timeout_callback");
+        if(timer == NULL)
         {
-            std::cerr << "send_packet: Error allocating timeout args recipient" << std::endl;
+            std::cerr << "send_packet: Error registering retransmission timer" << std::endl;
+            packet_free(timeargs->packet);
+            timeoutargs_pool.destroy(timeargs);
             return -1;
         }
-        timeargs->fd = rsocket;
-        memcpy(timeargs->packet, p, sizeof(rudp_packet));
-        memcpy(timeargs->recipient, recipient, sizeof(zts_sockaddr_in6));  
-    
-        zts_timeval currentTime;
-        gettimeofday((timeval *)&currentTime, NULL);
-        zts_timeval delay;
-        delay.tv_sec = RUDP_TIMEOUT/1000;
-        delay.tv_usec= 0;
-        zts_timeval timeout_time;
-        timeradd(&currentTime, &delay, &timeout_time);
-
-        rudp_socket_list *curr_socket = socket_list_head;
-        while(curr_socket != NULL)
-        {
-            if(curr_socket->rsock == timeargs->fd)
-            {
-                break;
-            }
-            curr_socket = curr_socket->next;
-        }
-        if(curr_socket->rsock == timeargs->fd)
+
         {
             bool session_found = false;
             /* Check if we already have a session for this peer */
-            session *curr_session = curr_socket->sessions_list_head;
+            session *curr_session = socket->sessions_list_head;
             while(curr_session != NULL)
             {
-                if(compare_sockaddr(&curr_session->address, timeargs->recipient) == 1)
+                if(compare_sockaddr(&curr_session->address, &timeargs->recipient) == 1)
                 {
                     /* Found an existing session */
                     session_found = true;
@@ -1196,29 +1888,355 @@ int send_packet(bool is_ack, rudp_socket_t rsocket, rudp_packet *p, zts_sockaddr
             {
                 if(timeargs->packet->header.type == RUDP_SYN)
                 {
-                    curr_session->sender->syn_timeout_arg = timeargs;
+                    curr_session->sender->syn_timer = timer;
                 }
                 else if(timeargs->packet->header.type == RUDP_FIN)
                 {
-                    curr_session->sender->fin_timeout_arg = timeargs;
+                    curr_session->sender->fin_timer = timer;
                 }
                 else if(timeargs->packet->header.type == RUDP_DATA)
                 {
-                    int i;
-                    int index;
-                    for(i = 0; i < RUDP_WINDOW; i++)
+                    window_slot *slot = window_find(curr_session->sender, timeargs->packet->header.seqno);
+                    if(slot != NULL)
                     {
-                        if(curr_session->sender->sliding_window[i] != NULL && 
-                            curr_session->sender->sliding_window[i]->header.seqno == timeargs->packet->header.seqno)
-                        {
-                            index = i;
-                        }
+                        slot->timer = timer;
                     }
-                    curr_session->sender->data_timeout_arg[index] = timeargs;
                 }
             }
         }
-        event_timeout(timeout_time, timeout_callback, timeargs, "timeout_callback");
     }
     return 0;
 }
+
+/*
+ * Looks up a socket by its handle and takes a reference to it, so that it
+ * stays allocated even if its loop closes it meanwhile. Returns NULL if there
+ * is no such socket.
+ */
+rudp_socket_list *acquire_socket(rudp_socket_t rsocket)
+{
+    std::shared_lock<std::shared_mutex> socket_map_sl(socket_map_mut);
+    auto found = socket_map.find(rsocket);
+    if(found == socket_map.end())
+    {
+        return NULL;
+    }
+    found->second->refs.fetch_add(1, std::memory_order_relaxed);
+    return found->second;
+}
+
+/* Drops a reference to a socket, the last one frees it */
+void release_socket(rudp_socket_list *socket)
+{
+    if(socket != NULL && socket->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        delete socket;
+    }
+}
+
+/* Sends what the socket still has queued, closes it and frees it. On the socket's loop thread */
+void destroy_socket(rudp_socket_list *socket)
+{
+    flush_packets(socket);
+    if(socket->flush_deferred)
+    {
+        event_defer_delete(socket->loop, flush_callback, socket);
+    }
+    if(socket->close_requested)
+    {
+        event_defer_delete(socket->loop, close_callback, socket);
+    }
+    if(socket->ack_timer != NULL)
+    {
+        event_timer_cancel(socket->ack_timer);
+    }
+    event_fd_delete(socket->loop, receive_callback, socket);
+    socket->transport->close(static_cast<int>((uint64_t)socket->rsock));
+    remove_socket(socket);
+    /* Commands still in flight hold references and find it destroyed */
+    socket->destroyed = true;
+    release_socket(socket);
+}
+
+/* Removes a socket from the socket map */
+void remove_socket(rudp_socket_list *socket)
+{
+    std::lock_guard<std::shared_mutex> socket_map_lg(socket_map_mut);
+    socket_map.erase(socket->rsock);
+}
+
+/* Payload copy counters, -1 if they are not compiled in */
+int rudp_copy_stats(struct rudp_copy_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+#ifdef RUDP_COPY_STATS
+    stats->send_accepted = copy_stats[SEND_ACCEPTED].load(std::memory_order_relaxed);
+    stats->send_copied = copy_stats[SEND_COPIED].load(std::memory_order_relaxed);
+    stats->receive_delivered = copy_stats[RECEIVE_DELIVERED].load(std::memory_order_relaxed);
+    stats->receive_copied = copy_stats[RECEIVE_COPIED].load(std::memory_order_relaxed);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* Object pool counters, the pools of the event loops included */
+int rudp_pool_stats(struct rudp_pool_stats *stats, int max)
+{
+    int count = 0;
+    for(ObjectPool *pool = ObjectPool::first(); pool != NULL; pool = pool->next())
+    {
+        if(count < max)
+        {
+            object_pool_stats pool_stats = pool->stats();
+            stats[count].name = pool_stats.name;
+            stats[count].slab_mallocs = pool_stats.slab_mallocs;
+            stats[count].allocated = pool_stats.allocated;
+            stats[count].in_use = pool_stats.in_use;
+            stats[count].in_use_max = pool_stats.in_use_max;
+        }
+        count++;
+    }
+    return count;
+}
+
+/* The event loop serving a socket */
+struct event_loop *rudp_socket_loop(rudp_socket_t rsocket)
+{
+    /* Read the loop under the lock, the socket may be freed by its loop meanwhile */
+    std::shared_lock<std::shared_mutex> socket_map_sl(socket_map_mut);
+    auto found = socket_map.find(rsocket);
+    return found != socket_map.end() ? found->second->loop : NULL;
+}
+
+/* Allocates a command for the socket <rsocket> */
+socket_command *create_command(int type, rudp_socket_t rsocket)
+{
+    socket_command *cmd = command_pool.create<socket_command>();
+    if(cmd == NULL)
+    {
+        std::cerr << "create_command: Error allocating memory" << std::endl;
+        return NULL;
+    }
+    memset(cmd, 0, sizeof(socket_command));
+    cmd->type = (decltype(cmd->type))type;
+    cmd->rsock = rsocket;
+    return cmd;
+}
+
+/* Releases a command along with its payload and its reference to the socket */
+void free_command(socket_command *cmd)
+{
+    payload_release(cmd->payload);
+    release_socket(cmd->socket);
+    command_pool.destroy(cmd);
+}
+
+/*
+ * Executes a command on the socket's event loop and releases it. Called on
+ * that loop's thread it runs right away, from any other thread it is posted
+ * to the loop, so the protocol state is only ever touched by the loop thread.
+ * Returns -1 if the socket does not exist or the command could not be posted.
+ */
+int submit_command(socket_command *cmd)
+{
+    /* The only lookup of the handle, the loop thread uses the socket it resolves to */
+    cmd->socket = acquire_socket(cmd->rsock);
+    if(cmd->socket == NULL)
+    {
+        std::cerr << "Error: attempt to use an invalid socket. Socket not found" << std::endl;
+        free_command(cmd);
+        return -1;
+    }
+    if(event_loop_current() == cmd->socket->loop)
+    {
+        int result = execute_command(cmd);
+        free_command(cmd);
+        return result;
+    }
+    if(event_post(cmd->socket->loop, command_callback, cmd) < 0)
+    {
+        free_command(cmd);
+        return -1;
+    }
+    return 0;
+}
+
+/* Performs a command, on the loop thread of its socket */
+int execute_command(socket_command *cmd)
+{
+    if(cmd->type == socket_command::SENDTO)
+    {
+        return socket_sendto(cmd->socket, cmd->payload, &cmd->to);
+    }
+    rudp_socket_list *curr_socket = cmd->socket;
+    if(curr_socket->destroyed)
+    {
+        std::cerr << "Error: command for a closed socket" << std::endl;
+        return -1;
+    }
+    switch(cmd->type)
+    {
+        case socket_command::CLOSE:
+            if(curr_socket->close_requested)
+            {
+                break;
+            }
+            curr_socket->close_requested = true;
+            /* Sessions already done get no packet that would close the socket */
+            send_fins(curr_socket);
+            if(sessions_finished(curr_socket) && event_defer(curr_socket->loop, close_callback, curr_socket) < 0)
+            {
+                return -1;
+            }
+            break;
+        case socket_command::RECV_HANDLER:
+            curr_socket->recv_handler = cmd->recv_handler;
+            break;
+        case socket_command::EVENT_HANDLER:
+            curr_socket->handler = cmd->handler;
+            break;
+        case socket_command::TIMER_SLACK:
+            curr_socket->timer_slack = cmd->timer_slack;
+            break;
+        case socket_command::WINDOW:
+            curr_socket->window = cmd->window;
+            for(session *curr_session = curr_socket->sessions_list_head; curr_session != NULL; curr_session = curr_session->next)
+            {
+                if(curr_session->sender == NULL)
+                {
+                    continue;
+                }
+                if(window_resize(curr_session->sender, cmd->window) < 0)
+                {
+                    std::cerr << "rudp_window: Error allocating memory" << std::endl;
+                    return -1;
+                }
+                if(curr_session->sender->status == OPEN)
+                {
+                    window_fill(curr_socket, curr_session);
+                }
+            }
+            break;
+        case socket_command::DELAYED_ACK:
+            curr_socket->ack_every = cmd->ack_every;
+            curr_socket->ack_delay = cmd->ack_delay;
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+/* Event callback running a posted command */
+int command_callback(int, void *arg)
+{
+    socket_command *cmd = (socket_command *)arg;
+    /* Errors are already reported, they must not stop the loop */
+    execute_command(cmd);
+    free_command(cmd);
+    return 0;
+}
+
+/* Starts <loops> event loops, each on its own thread. Returns 0 on success, -1 on error */
+int rudp_engine_start(int loops)
+{
+    std::lock_guard<std::mutex> engine_lg(engine_mut);
+    if(loops < 1 || !engine_loops.empty())
+    {
+        std::cerr << "rudp_engine_start: invalid loop count or engine already running" << std::endl;
+        return -1;
+    }
+    int i;
+    for(i = 0; i < loops; i++)
+    {
+        event_loop_t *loop = event_loop_new();
+        if(loop == NULL)
+        {
+            std::cerr << "rudp_engine_start: Error creating event loop" << std::endl;
+            break;
+        }
+        if(event_loop_set_transport(loop, engine_transport) < 0)
+        {
+            event_loop_free(loop);
+            break;
+        }
+        engine_loops.push_back(loop);
+        engine_threads.emplace_back([loop]() { eventloop_run(loop); });
+    }
+    if(i < loops)
+    {
+        for(i = 0; i < (int)engine_threads.size(); i++)
+        {
+            eventloop_stop(engine_loops[i]);
+            engine_threads[i].join();
+            event_loop_free(engine_loops[i]);
+        }
+        engine_threads.clear();
+        engine_loops.clear();
+        return -1;
+    }
+    engine_next_loop = 0;
+    return 0;
+}
+
+/* Stops the engine's loops and joins their threads. Returns 0 on success, -1 if no engine is running or its sockets are open */
+int rudp_engine_stop()
+{
+    std::lock_guard<std::mutex> engine_lg(engine_mut);
+    if(engine_loops.empty())
+    {
+        return -1;
+    }
+    {
+        /* Closing takes a FIN/ACK exchange, a socket still open would post into a freed loop */
+        std::shared_lock<std::shared_mutex> socket_map_sl(socket_map_mut);
+        for(auto &open_socket : socket_map)
+        {
+            if(std::find(engine_loops.begin(), engine_loops.end(), open_socket.second->loop) != engine_loops.end())
+            {
+                std::cerr << "rudp_engine_stop: sockets served by the engine are open" << std::endl;
+                return -1;
+            }
+        }
+    }
+    size_t i;
+    for(i = 0; i < engine_loops.size(); i++)
+    {
+        eventloop_stop(engine_loops[i]);
+    }
+    for(i = 0; i < engine_threads.size(); i++)
+    {
+        engine_threads[i].join();
+        event_loop_free(engine_loops[i]);
+    }
+    engine_threads.clear();
+    engine_loops.clear();
+    return 0;
+}
+
+/* Selects the transport of the sockets created afterwards. Returns 0 on success, -1 if sockets or loops are using the current one */
+int rudp_set_transport(const struct transport *transport)
+{
+    std::lock_guard<std::mutex> engine_lg(engine_mut);
+    if(transport == NULL || !engine_loops.empty())
+    {
+        std::cerr << "rudp_set_transport: no transport given or engine running" << std::endl;
+        return -1;
+    }
+    {
+        std::shared_lock<std::shared_mutex> socket_map_sl(socket_map_mut);
+        if(!socket_map.empty())
+        {
+            std::cerr << "rudp_set_transport: sockets are open" << std::endl;
+            return -1;
+        }
+    }
+    /* Without an engine the sockets are served by the default loop */
+    if(event_loop_set_transport(event_loop_default(), transport) < 0)
+    {
+        return -1;
+    }
+    engine_transport = transport;
+    return 0;
+}
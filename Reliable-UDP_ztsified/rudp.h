@@ -1,11 +1,21 @@
 #ifndef RUDP_PROTO_H
 #define	RUDP_PROTO_H
 
-#define RUDP_VERSION	1	/* Protocol version */
+#define RUDP_VERSION	2	/* Protocol version */
+#define RUDP_VERSION_LEGACY 1	/* Version of peers using the fixed size wire format */
 #define RUDP_MAXPKTSIZE 1000	/* Number of data bytes that can sent in a packet, RUDP header not included */
 #define RUDP_MAXRETRANS 5	/* Max. number of retransmissions */
 #define RUDP_TIMEOUT	2000	/* Timeout for the first retransmission in milliseconds */
-#define RUDP_WINDOW	    3	/* Max. number of unacknowledged packets that can be sent to the network*/
+#define RUDP_WINDOW 3	/* Default max. number of unacknowledged packets that can be sent to the network, see rudp_window() */
+#define RUDP_WINDOW_MAX 4096	/* Largest window a socket can be given, well below half the range of the SEQ_ macros */
+#define RUDP_TIMER_SLACK 20	/* Default slack of the retransmission timers in milliseconds */
+#define RUDP_RECV_BATCH 32	/* Max. number of datagrams read from a socket per readiness event */
+#define RUDP_SEND_BATCH 32	/* Max. number of datagrams a socket queues before sending them in one batch */
+#define RUDP_REORDER_MAX RUDP_WINDOW_MAX	/* Max. number of DATA packets a receiver buffers ahead of a missing one */
+#define RUDP_SACK_MAX 8	/* Max. number of SACK ranges in an ACK */
+#define RUDP_SACK_THRESH 3	/* SACKed packets past a missing one before it is retransmitted without waiting for its timer */
+#define RUDP_ACK_EVERY 2	/* Default number of in-order DATA packets a receiver ACKs at once, see rudp_delayed_ack() */
+#define RUDP_ACK_DELAY 10	/* Default time in milliseconds a receiver holds back an ACK for fewer packets */
 
 /* Packet types */
 
@@ -14,6 +24,11 @@
 #define RUDP_SYN	4
 #define RUDP_FIN	5
 
+/* Flags a version 2 sender sets in the type field above the packet type */
+
+#define RUDP_TYPE_MASK	0x00ff	/* Bits of the type field that hold the packet type */
+#define RUDP_FLAG_PUSH	0x0100	/* DATA after which the sender has nothing more to send until ACKed */
+
 /*
  * Sequence numbers are 32-bit integers operated on with modular arithmetic.
  * These macros can be used to compare sequence numbers.
@@ -24,6 +39,29 @@
 #define	SEQ_GT(a,b) ((short)((a)-(b)) > 0)
 #define	SEQ_GEQ(a,b) ((short)((a)-(b)) >= 0)
 
+/*
+ * Wire format. A version 2 datagram is the header followed by the payload,
+ * the payload length is the rest of the datagram. Version 1 datagrams are
+ * the header, a 4 byte payload length and always RUDP_MAXPKTSIZE payload
+ * bytes. Version 1 peers ignore the version field, so they understand
+ * version 2 control packets, and they ACK a SYN with version 1, which
+ * tells the sender to fall back to version 1 DATA packets.
+ *
+ * The sequence number of an ACK is the next one the receiver expects,
+ * every packet before it has arrived. Version 2 receivers may delay the
+ * ACK for in-order DATA, so one ACK can cover several packets, but ACK
+ * right away whenever a packet is missing, duplicated or fills a gap, or
+ * when a DATA packet carries RUDP_FLAG_PUSH: the sender sets it on the
+ * packet that fills its window or empties its queue, as it sends nothing
+ * more until that packet is ACKed.
+ * Version 1 senders get an ACK for each DATA packet. A version 2 ACK may
+ * carry up to RUDP_SACK_MAX rudp_sack ranges as its payload, each one a
+ * run of packets past a missing one that the receiver holds in its
+ * reorder buffer. Version 1 peers are sent no ranges.
+ */
+
+#define RUDP_LEGACY_PKTSIZE (sizeof(struct rudp_hdr) + 4 + RUDP_MAXPKTSIZE)
+
 /* RUDP packet header */
 
 struct rudp_hdr
@@ -33,4 +71,12 @@ struct rudp_hdr
     u_int32_t seqno;
 }__attribute__ ((packed));
 
+/* SACK range: the packets start up to, not including, end have arrived */
+
+struct rudp_sack
+{
+    u_int32_t start;
+    u_int32_t end;
+}__attribute__ ((packed));
+
 #endif /* RUDP_PROTO_H */
@@ -5,6 +5,10 @@
 
 #define RUDP_MAXPKTSIZE 1000    /* Number of data bytes that can sent in a
                                  * packet, RUDP header not included */
+#define RUDP_WINDOW 3           /* Window of new sockets, see rudp_window() */
+#define RUDP_WINDOW_MAX 4096    /* Largest window of a socket */
+#define RUDP_ACK_EVERY 2        /* ACK policy of new sockets, see rudp_delayed_ack() */
+#define RUDP_ACK_DELAY 10
 
 /*
  * Event types for callback notifications
@@ -22,6 +26,18 @@ typedef enum
 
 typedef void *rudp_socket_t;
 
+/*
+ * Event loop, see event.h
+ */
+
+struct event_loop;
+
+/*
+ * Datagram transport, see transport.h
+ */
+
+struct transport;
+
 /*
  * Prototypes
  */
@@ -33,11 +49,17 @@ rudp_socket_t rudp_socket(int port);
 
 /* 
  * Socket termination
+ * Asynchronous: returns 0 once the close is queued for the socket's loop,
+ * which sends the FINs and reports RUDP_EVENT_CLOSED when they are ACKed.
+ * Failures on the loop only show up on stderr.
  */
 int rudp_close(rudp_socket_t rsocket);
 
 /* 
  * Send a datagram 
+ * Asynchronous: returns 0 once a copy of <data> is queued for the socket's
+ * loop, -1 if the socket does not exist or the copy cannot be made. Failures
+ * on the loop, such as a socket closed meanwhile, only show up on stderr.
  */
 int rudp_sendto(rudp_socket_t rsocket, void* data, int len, 
         zts_sockaddr_in6 *to);
@@ -58,4 +80,90 @@ int rudp_event_handler(rudp_socket_t rsocket,
                int (*handler)(rudp_socket_t, 
                       rudp_event_t, 
                       zts_sockaddr_in6 *));
+
+/*
+ * Let the retransmission timers of a socket fire up to <slack_ms> - 1
+ * milliseconds late, so that timers armed within the same <slack_ms>
+ * interval share one wakeup of the event loop. 0 retransmits exactly
+ * RUDP_TIMEOUT after each send. Applies to packets sent afterwards.
+ */
+int rudp_timer_slack(rudp_socket_t rsocket, int slack_ms);
+
+/*
+ * Let the sessions of a socket have up to <packets> DATA packets in flight,
+ * 1 to RUDP_WINDOW_MAX. Sockets start with RUDP_WINDOW. Applies to the
+ * sessions the socket has and to those it opens afterwards.
+ */
+int rudp_window(rudp_socket_t rsocket, int packets);
+
+/*
+ * Let the receiving sessions of a socket ACK in-order DATA once every
+ * <packets> packets, or <delay_ms> milliseconds after the first one not
+ * yet ACKed, whichever comes first. A missing, duplicated or reordered
+ * packet is ACKed at once, and so is the packet that fills the sender's
+ * window or empties its queue. 1 packet ACKs every packet, as version 1
+ * peers are always ACKed. <delay_ms> has to stay below RUDP_TIMEOUT.
+ * Sockets start with RUDP_ACK_EVERY packets and RUDP_ACK_DELAY milliseconds.
+ */
+int rudp_delayed_ack(rudp_socket_t rsocket, int packets, int delay_ms);
+
+/*
+ * Carry the RUDP sockets created afterwards over <transport>: transport_zts
+ * (the default), transport_udp for kernel UDP sockets or transport_loopback
+ * for in-process delivery. Has to be called while no sockets are open and
+ * no engine is running, and before the default loop is run.
+ */
+int rudp_set_transport(const struct transport *transport);
+
+/*
+ * Start <loops> event loops, each on its own thread. Sockets created
+ * afterwards are assigned to them round-robin and are served by their loop
+ * only. Without an engine every socket uses the default loop, which the
+ * application runs with eventloop(event_loop_default()).
+ */
+int rudp_engine_start(int loops);
+
+/*
+ * Stop the engine's loops and join their threads. Sockets assigned to them
+ * have to be closed first: closing completes asynchronously, wait for their
+ * RUDP_EVENT_CLOSED. Returns -1 and leaves the engine running while any of
+ * them is still open.
+ */
+int rudp_engine_stop();
+
+/*
+ * The event loop serving a socket. Timers and descriptors related to the
+ * socket belong on this loop, so they are dispatched by the same thread.
+ */
+struct event_loop *rudp_socket_loop(rudp_socket_t rsocket);
+
+/*
+ * Payload bytes accepted by rudp_sendto() and delivered to receive handlers,
+ * and the payload bytes the engine copied on the way, retransmissions
+ * included. Copies made by the transport are not counted. Only kept when
+ * the library is built with -DRUDP_COPY_STATS, returns -1 otherwise.
+ */
+struct rudp_copy_stats {
+    unsigned long long send_accepted;
+    unsigned long long send_copied;
+    unsigned long long receive_delivered;
+    unsigned long long receive_copied;
+};
+int rudp_copy_stats(struct rudp_copy_stats *stats);
+
+/*
+ * Counters of the object pools the engine and its event loops allocate
+ * packets, timers, queue entries, sessions and posted callbacks from. An
+ * in_use_max that stays constant while slab_mallocs does not grow means
+ * the traffic is served without heap allocations. Fills at most <max>
+ * entries and returns how many pools there are.
+ */
+struct rudp_pool_stats {
+    const char *name;
+    unsigned long long slab_mallocs;
+    unsigned long long allocated;
+    unsigned long long in_use;
+    unsigned long long in_use_max;
+};
+int rudp_pool_stats(struct rudp_pool_stats *stats, int max);
 #endif /* RUDP_API_H */
@@ -0,0 +1,882 @@
+/*
+* Datagram transports: libzt, kernel UDP, an in-process loopback and a link
+* emulator layered over any of them. See transport.h.
+*/
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <new>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "transport.h"
+
+#define LOOPBACK_QUEUE_MAX 4096 /* Datagrams queued per loopback socket, like a socket buffer */
+#define LOOPBACK_EPHEMERAL_PORT 49152 /* First port handed out for port 0 */
+#define UDP_MMSG_MAX 64 /* Datagrams per recvmmsg() and sendmmsg() call */
+#define GATHER_MAX 65536 /* Largest datagram gathered into one buffer */
+#define IMPAIR_CHUNK 32 /* Datagrams of a batch routed before the immediate ones are sent */
+
+/*
+* libzt
+*/
+static int
+libzt_open(const zts_sockaddr_in6 *addr, bool nonblocking)
+{
+    int fd;
+
+    fd = zts_socket(ZTS_AF_INET6, ZTS_SOCK_DGRAM, 0);
+    if (fd < 0)
+        return -1;
+    if (zts_bind(fd, (zts_sockaddr *)addr, sizeof(*addr)) < 0 ||
+        (nonblocking && zts_fcntl(fd, ZTS_F_SETFL, zts_fcntl(fd, ZTS_F_GETFL, 0) | ZTS_O_NONBLOCK) < 0))
+    {
+        zts_close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int
+libzt_local_address(int fd, zts_sockaddr_in6 *addr)
+{
+    zts_socklen_t addr_len = sizeof(*addr);
+
+    return zts_getsockname(fd, (zts_sockaddr *)addr, &addr_len) < 0 ? -1 : 0;
+}
+
+static int
+libzt_sendto(int fd, const void *buf, int len, const zts_sockaddr_in6 *to)
+{
+    return zts_sendto(fd, buf, len, 0, (zts_sockaddr *)to, sizeof(*to)) < 0 ? -1 : len;
+}
+
+static int
+libzt_recvfrom(int fd, void *buf, int len, zts_sockaddr_in6 *from)
+{
+    zts_socklen_t from_len = sizeof(*from);
+
+    if (from == NULL)
+        return zts_recvfrom(fd, buf, len, 0, NULL, NULL);
+    return zts_recvfrom(fd, buf, len, 0, (zts_sockaddr *)from, &from_len);
+}
+
+/* libzt has no recvmmsg(), so read one datagram after the other */
+static int
+libzt_recv_batch(int fd, transport_datagram *batch, int count)
+{
+    zts_socklen_t from_len;
+    int i, n;
+
+    for (i = 0; i < count; i++)
+    {
+        from_len = sizeof(batch[i].addr);
+        n = zts_recvfrom(fd, batch[i].buf, batch[i].size, ZTS_MSG_DONTWAIT, (zts_sockaddr *)&batch[i].addr, &from_len);
+        if (n < 0)
+            break;
+        batch[i].len = n;
+    }
+    return i;
+}
+
+/* Copy the segments of <datagram> into <buf>. Returns the length, -1 if it does not fit. */
+static int
+gather(const transport_datagram *datagram, char *buf, int size)
+{
+    int i, len = 0;
+
+    for (i = 0; i < datagram->iovcnt; i++)
+    {
+        if (datagram->iov[i].len > size - len)
+            return -1;
+        memcpy(buf + len, datagram->iov[i].base, datagram->iov[i].len);
+        len += datagram->iov[i].len;
+    }
+    return len;
+}
+
+/*
+* Nor sendmmsg(). lwIP copies every datagram into a pbuf anyway, so the
+* segments are gathered into one buffer first.
+*/
+static int
+libzt_send_batch(int fd, const transport_datagram *batch, int count)
+{
+    static thread_local char buf[GATHER_MAX];
+    int i, len;
+
+    for (i = 0; i < count; i++)
+    {
+        len = gather(&batch[i], buf, sizeof(buf));
+        if (len < 0 || zts_sendto(fd, buf, len, 0, (zts_sockaddr *)&batch[i].addr, sizeof(batch[i].addr)) < 0)
+            break;
+    }
+    return i == 0 && count > 0 ? -1 : i;
+}
+
+static int
+libzt_poll(zts_pollfd *fds, int nfds, int timeout_ms)
+{
+    return zts_poll(fds, nfds, timeout_ms);
+}
+
+static int
+libzt_close(int fd)
+{
+    return zts_close(fd);
+}
+
+const transport_t transport_zts = {
+    "zts", libzt_open, libzt_local_address, libzt_sendto, libzt_recvfrom, libzt_recv_batch, libzt_send_batch, libzt_poll, libzt_close,
+};
+
+/*
+* Kernel UDP. zts_sockaddr_in6 has the lwIP layout, so addresses are
+* converted field by field.
+*/
+static_assert(sizeof(zts_pollfd) == sizeof(struct pollfd), "zts_pollfd must match struct pollfd");
+static_assert(ZTS_POLLIN == POLLIN, "ZTS_POLLIN must match POLLIN");
+
+static void
+udp_addr_to_kernel(const zts_sockaddr_in6 *addr, struct sockaddr_in6 *kernel_addr)
+{
+    memset(kernel_addr, 0, sizeof(*kernel_addr));
+    kernel_addr->sin6_family = AF_INET6;
+    kernel_addr->sin6_port = addr->sin6_port;
+    kernel_addr->sin6_flowinfo = addr->sin6_flowinfo;
+    memcpy(&kernel_addr->sin6_addr, &addr->sin6_addr, sizeof(kernel_addr->sin6_addr));
+    kernel_addr->sin6_scope_id = addr->sin6_scope_id;
+}
+
+static void
+udp_addr_from_kernel(const struct sockaddr_in6 *kernel_addr, zts_sockaddr_in6 *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin6_family = ZTS_AF_INET6;
+    addr->sin6_port = kernel_addr->sin6_port;
+    addr->sin6_flowinfo = kernel_addr->sin6_flowinfo;
+    memcpy(&addr->sin6_addr, &kernel_addr->sin6_addr, sizeof(kernel_addr->sin6_addr));
+    addr->sin6_scope_id = kernel_addr->sin6_scope_id;
+}
+
+static int
+udp_open(const zts_sockaddr_in6 *addr, bool nonblocking)
+{
+    struct sockaddr_in6 kernel_addr;
+    int fd;
+
+    fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+    if (fd < 0)
+        return -1;
+    udp_addr_to_kernel(addr, &kernel_addr);
+    if (bind(fd, (struct sockaddr *)&kernel_addr, sizeof(kernel_addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int
+udp_local_address(int fd, zts_sockaddr_in6 *addr)
+{
+    struct sockaddr_in6 kernel_addr;
+    socklen_t addr_len = sizeof(kernel_addr);
+
+    if (getsockname(fd, (struct sockaddr *)&kernel_addr, &addr_len) < 0)
+        return -1;
+    udp_addr_from_kernel(&kernel_addr, addr);
+    return 0;
+}
+
+static int
+udp_sendto(int fd, const void *buf, int len, const zts_sockaddr_in6 *to)
+{
+    struct sockaddr_in6 kernel_addr;
+
+    udp_addr_to_kernel(to, &kernel_addr);
+    return sendto(fd, buf, len, 0, (struct sockaddr *)&kernel_addr, sizeof(kernel_addr)) < 0 ? -1 : len;
+}
+
+static int
+udp_recvfrom(int fd, void *buf, int len, zts_sockaddr_in6 *from)
+{
+    struct sockaddr_in6 kernel_addr;
+    socklen_t addr_len = sizeof(kernel_addr);
+    int n;
+
+    n = recvfrom(fd, buf, len, 0, (struct sockaddr *)&kernel_addr, &addr_len);
+    if (n >= 0 && from)
+        udp_addr_from_kernel(&kernel_addr, from);
+    return n;
+}
+
+static int
+udp_recv_batch(int fd, transport_datagram *batch, int count)
+{
+    struct mmsghdr msgs[UDP_MMSG_MAX];
+    struct iovec iovs[UDP_MMSG_MAX];
+    struct sockaddr_in6 addrs[UDP_MMSG_MAX];
+    int i, n, chunk, received = 0;
+
+    while (received < count)
+    {
+        chunk = count - received < UDP_MMSG_MAX ? count - received : UDP_MMSG_MAX;
+        memset(msgs, 0, chunk * sizeof(msgs[0]));
+        for (i = 0; i < chunk; i++)
+        {
+            iovs[i].iov_base = batch[received + i].buf;
+            iovs[i].iov_len = batch[received + i].size;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+        n = recvmmsg(fd, msgs, chunk, MSG_DONTWAIT, NULL);
+        if (n <= 0)
+            break;
+        for (i = 0; i < n; i++)
+        {
+            batch[received + i].len = msgs[i].msg_len;
+            udp_addr_from_kernel(&addrs[i], &batch[received + i].addr);
+        }
+        received += n;
+        /* The socket is drained */
+        if (n < chunk)
+            break;
+    }
+    return received;
+}
+
+static int
+udp_send_batch(int fd, const transport_datagram *batch, int count)
+{
+    struct mmsghdr msgs[UDP_MMSG_MAX];
+    struct iovec iovs[UDP_MMSG_MAX][TRANSPORT_IOV_MAX];
+    struct sockaddr_in6 addrs[UDP_MMSG_MAX];
+    int i, j, n, chunk, sent = 0;
+
+    while (sent < count)
+    {
+        chunk = count - sent < UDP_MMSG_MAX ? count - sent : UDP_MMSG_MAX;
+        memset(msgs, 0, chunk * sizeof(msgs[0]));
+        for (i = 0; i < chunk; i++)
+        {
+            const transport_datagram *datagram = &batch[sent + i];
+            for (j = 0; j < datagram->iovcnt; j++)
+            {
+                iovs[i][j].iov_base = (void *)datagram->iov[j].base;
+                iovs[i][j].iov_len = datagram->iov[j].len;
+            }
+            udp_addr_to_kernel(&datagram->addr, &addrs[i]);
+            msgs[i].msg_hdr.msg_iov = iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = datagram->iovcnt;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+        n = sendmmsg(fd, msgs, chunk, 0);
+        if (n <= 0)
+            break;
+        sent += n;
+        if (n < chunk)
+            break;
+    }
+    return sent == 0 && count > 0 ? -1 : sent;
+}
+
+static int
+udp_poll(zts_pollfd *fds, int nfds, int timeout_ms)
+{
+    return poll((struct pollfd *)fds, nfds, timeout_ms);
+}
+
+static int
+udp_close(int fd)
+{
+    return close(fd);
+}
+
+const transport_t transport_udp = {
+    "udp", udp_open, udp_local_address, udp_sendto, udp_recvfrom, udp_recv_batch, udp_send_batch, udp_poll, udp_close,
+};
+
+/*
+* In-process loopback. Every socket is a queue of datagrams, the handle is
+* its index in loopback_sockets. One mutex guards all of them and one
+* condition variable wakes up pollers and blocking receivers whenever a
+* datagram is queued or a socket closed.
+*/
+struct loopback_datagram {
+    zts_sockaddr_in6 from;
+    std::vector<char> data;
+};
+
+struct loopback_socket {
+    int port;
+    bool nonblocking;
+    std::deque<loopback_datagram> queue;
+};
+
+static std::mutex loopback_mut;
+static std::condition_variable loopback_cv;
+static std::vector<loopback_socket *> loopback_sockets;
+static std::unordered_map<int, int> loopback_ports; /* port -> handle */
+static int loopback_next_port = LOOPBACK_EPHEMERAL_PORT;
+
+static loopback_socket *
+loopback_get(int fd)
+{
+    if (fd < 0 || fd >= (int)loopback_sockets.size())
+        return NULL;
+    return loopback_sockets[fd];
+}
+
+static int
+loopback_open(const zts_sockaddr_in6 *addr, bool nonblocking)
+{
+    std::lock_guard<std::mutex> loopback_lg(loopback_mut);
+    struct loopback_socket *sock;
+    int fd, port = zts_ntohs(addr->sin6_port);
+
+    if (port == 0)
+    {
+        while (loopback_ports.count(loopback_next_port))
+            loopback_next_port = loopback_next_port == 65535 ? LOOPBACK_EPHEMERAL_PORT : loopback_next_port + 1;
+        port = loopback_next_port;
+    }
+    if (loopback_ports.count(port))
+        return -1;
+    sock = new (std::nothrow) loopback_socket;
+    if (sock == NULL)
+        return -1;
+    sock->port = port;
+    sock->nonblocking = nonblocking;
+    for (fd = 0; fd < (int)loopback_sockets.size() && loopback_sockets[fd]; fd++)
+        ;
+    if (fd == (int)loopback_sockets.size())
+        loopback_sockets.push_back(sock);
+    else
+        loopback_sockets[fd] = sock;
+    loopback_ports[port] = fd;
+    return fd;
+}
+
+static int
+loopback_local_address(int fd, zts_sockaddr_in6 *addr)
+{
+    std::lock_guard<std::mutex> loopback_lg(loopback_mut);
+    struct loopback_socket *sock = loopback_get(fd);
+
+    if (sock == NULL)
+        return -1;
+    memset(addr, 0, sizeof(*addr));
+    addr->sin6_family = ZTS_AF_INET6;
+    addr->sin6_port = zts_htons(sock->port);
+    ((unsigned char *)&addr->sin6_addr)[15] = 1; /* ::1 */
+    return 0;
+}
+
+/* Queue a datagram gathered from <iov> on the socket bound to the port of <to>, loopback_mut held */
+static void
+loopback_deliver(struct loopback_socket *sock, const transport_iovec *iov, int iovcnt, const zts_sockaddr_in6 *to)
+{
+    struct loopback_socket *peer;
+    std::unordered_map<int, int>::iterator found;
+
+    found = loopback_ports.find(zts_ntohs(to->sin6_port));
+    /* Like UDP, datagrams nobody listens for and those that overflow the queue are dropped */
+    if (found == loopback_ports.end())
+        return;
+    peer = loopback_sockets[found->second];
+    if (peer->queue.size() >= LOOPBACK_QUEUE_MAX)
+        return;
+    peer->queue.emplace_back();
+    loopback_datagram &datagram = peer->queue.back();
+    memset(&datagram.from, 0, sizeof(datagram.from));
+    datagram.from.sin6_family = ZTS_AF_INET6;
+    datagram.from.sin6_port = zts_htons(sock->port);
+    ((unsigned char *)&datagram.from.sin6_addr)[15] = 1;
+    for (int i = 0; i < iovcnt; i++)
+        datagram.data.insert(datagram.data.end(), (const char *)iov[i].base, (const char *)iov[i].base + iov[i].len);
+}
+
+static int
+loopback_sendto(int fd, const void *buf, int len, const zts_sockaddr_in6 *to)
+{
+    std::lock_guard<std::mutex> loopback_lg(loopback_mut);
+    struct loopback_socket *sock = loopback_get(fd);
+    transport_iovec iov;
+
+    if (sock == NULL || len < 0)
+        return -1;
+    iov.base = buf;
+    iov.len = len;
+    loopback_deliver(sock, &iov, 1, to);
+    loopback_cv.notify_all();
+    return len;
+}
+
+static int
+loopback_send_batch(int fd, const transport_datagram *batch, int count)
+{
+    std::lock_guard<std::mutex> loopback_lg(loopback_mut);
+    struct loopback_socket *sock = loopback_get(fd);
+    int i;
+
+    if (sock == NULL)
+        return -1;
+    for (i = 0; i < count; i++)
+        loopback_deliver(sock, batch[i].iov, batch[i].iovcnt, &batch[i].addr);
+    loopback_cv.notify_all();
+    return count;
+}
+
+static int
+loopback_recvfrom(int fd, void *buf, int len, zts_sockaddr_in6 *from)
+{
+    std::unique_lock<std::mutex> loopback_ul(loopback_mut);
+    struct loopback_socket *sock;
+    int n;
+
+    for (;;)
+    {
+        sock = loopback_get(fd);
+        if (sock == NULL)
+            return -1;
+        if (!sock->queue.empty())
+            break;
+        if (sock->nonblocking)
+            return -1;
+        loopback_cv.wait(loopback_ul);
+    }
+    loopback_datagram &datagram = sock->queue.front();
+    n = (int)datagram.data.size() < len ? (int)datagram.data.size() : len;
+    memcpy(buf, datagram.data.data(), n);
+    if (from)
+        *from = datagram.from;
+    sock->queue.pop_front();
+    return n;
+}
+
+static int
+loopback_recv_batch(int fd, transport_datagram *batch, int count)
+{
+    std::lock_guard<std::mutex> loopback_lg(loopback_mut);
+    struct loopback_socket *sock = loopback_get(fd);
+    int i;
+
+    if (sock == NULL)
+        return -1;
+    for (i = 0; i < count && !sock->queue.empty(); i++)
+    {
+        loopback_datagram &datagram = sock->queue.front();
+        batch[i].len = (int)datagram.data.size() < batch[i].size ? (int)datagram.data.size() : batch[i].size;
+        memcpy(batch[i].buf, datagram.data.data(), batch[i].len);
+        batch[i].addr = datagram.from;
+        sock->queue.pop_front();
+    }
+    return i;
+}
+
+static int
+loopback_poll(zts_pollfd *fds, int nfds, int timeout_ms)
+{
+    std::unique_lock<std::mutex> loopback_ul(loopback_mut);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    struct loopback_socket *sock;
+    int i, ready;
+
+    for (;;)
+    {
+        ready = 0;
+        for (i = 0; i < nfds; i++)
+        {
+            sock = loopback_get(fds[i].fd);
+            fds[i].revents = sock && !sock->queue.empty() ? (fds[i].events & ZTS_POLLIN) : 0;
+            if (fds[i].revents)
+                ready++;
+        }
+        if (ready || timeout_ms == 0)
+            return ready;
+        if (timeout_ms < 0)
+            loopback_cv.wait(loopback_ul);
+        else if (loopback_cv.wait_until(loopback_ul, deadline) == std::cv_status::timeout)
+            timeout_ms = 0;
+    }
+}
+
+static int
+loopback_close(int fd)
+{
+    std::lock_guard<std::mutex> loopback_lg(loopback_mut);
+    struct loopback_socket *sock = loopback_get(fd);
+
+    if (sock == NULL)
+        return -1;
+    loopback_ports.erase(sock->port);
+    loopback_sockets[fd] = NULL;
+    delete sock;
+    loopback_cv.notify_all();
+    return 0;
+}
+
+const transport_t transport_loopback = {
+    "loopback", loopback_open, loopback_local_address, loopback_sendto, loopback_recvfrom, loopback_recv_batch, loopback_send_batch, loopback_poll, loopback_close,
+};
+
+/*
+* Impaired link. Every datagram sent is dropped, sent right away or put in
+* flight until it is due. The datagrams in flight are ordered by due time
+* and sent by the next poll or send that finds them due. One mutex guards
+* the profile, the generator and the datagrams in flight, and due datagrams
+* are sent with it held, so those due at the same time leave in order.
+*/
+struct impaired_datagram {
+    int fd;
+    zts_sockaddr_in6 to;
+    std::vector<char> data;
+};
+
+/* The datagrams a handle sends to one destination */
+struct impaired_flow {
+    int fd;
+    uint16_t port;
+    unsigned char addr[16];
+
+    bool operator<(const impaired_flow &other) const
+    {
+        if (fd != other.fd)
+            return fd < other.fd;
+        if (port != other.port)
+            return port < other.port;
+        return memcmp(addr, other.addr, sizeof(addr)) < 0;
+    }
+};
+
+static std::mutex impair_mut;
+static std::atomic<const transport_t *> impair_inner(&transport_zts);
+static transport_impairment impair_profile;
+static std::mt19937_64 impair_rng;
+static bool impair_bad; /* Gilbert-Elliott state of the link */
+static unsigned long long impair_link_free; /* when the rate limited link has sent what it accepted so far */
+static std::multimap<unsigned long long, impaired_datagram> impair_flight; /* due time -> datagram */
+static std::map<impaired_flow, unsigned long long> impair_flow_due; /* flow -> due time of its latest datagram */
+static std::unordered_map<int, zts_sockaddr_in6> impair_local; /* handle -> address it is bound to */
+static transport_impairment_stats impair_stats;
+static void (*impair_clock)(zts_timeval *now, void *arg); /* NULL for the monotonic clock, see transport_impair_clock() */
+static void *impair_clock_arg;
+
+static unsigned long long
+impair_now_us()
+{
+    if (impair_clock != NULL)
+    {
+        zts_timeval now;
+        impair_clock(&now, impair_clock_arg);
+        return (unsigned long long)now.tv_sec * 1000000ULL + now.tv_usec;
+    }
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Uniform in [0, 1), impair_mut held */
+static double
+impair_random()
+{
+    return (double)(impair_rng() >> 11) / (double)(1ULL << 53);
+}
+
+/* Send the datagrams in flight that are due at <now>, impair_mut held */
+static void
+impair_release(unsigned long long now)
+{
+    const transport_t *inner = impair_inner.load(std::memory_order_relaxed);
+
+    while (!impair_flight.empty() && impair_flight.begin()->first <= now)
+    {
+        impaired_datagram &datagram = impair_flight.begin()->second;
+        /* Like a router, the link does not tell the sender about failures */
+        inner->sendto(datagram.fd, datagram.data.data(), (int)datagram.data.size(), &datagram.to);
+        impair_flight.erase(impair_flight.begin());
+    }
+}
+
+/*
+* Datagrams a socket sends to itself, like the wakeup channel of an event
+* loop, never cross the link. impair_mut held.
+*/
+static bool
+impair_to_self(int fd, const zts_sockaddr_in6 *to)
+{
+    auto found = impair_local.find(fd);
+
+    return found != impair_local.end() && found->second.sin6_port == to->sin6_port
+        && memcmp(&found->second.sin6_addr, &to->sin6_addr, sizeof(to->sin6_addr)) == 0;
+}
+
+/*
+* Apply the profile to a datagram gathered from <iov>. Returns how many
+* copies of it are to be sent right away, 0 when it is dropped or put in
+* flight. impair_mut held.
+*/
+static int
+impair_route(int fd, const transport_iovec *iov, int iovcnt, const zts_sockaddr_in6 *to, unsigned long long now)
+{
+    const transport_impairment *profile = &impair_profile;
+    unsigned long long due = now;
+    int i, copies, len = 0;
+
+    if (impair_to_self(fd, to))
+        return 1;
+    impair_stats.datagrams++;
+    if (profile->burst_enter > 0)
+    {
+        if (impair_bad ? impair_random() < profile->burst_exit : impair_random() < profile->burst_enter)
+            impair_bad = !impair_bad;
+    }
+    if (impair_random() < (impair_bad ? profile->burst_loss : profile->loss))
+    {
+        impair_stats.dropped++;
+        return 0;
+    }
+    copies = impair_random() < profile->duplicate ? 2 : 1;
+    if (copies == 2)
+        impair_stats.duplicated++;
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].len;
+    if (profile->queue_limit > 0 && (int)impair_flight.size() + copies > profile->queue_limit)
+    {
+        impair_stats.queue_drops++;
+        return 0;
+    }
+    if (profile->rate_bps > 0)
+    {
+        impair_link_free = (impair_link_free > now ? impair_link_free : now) + (unsigned long long)len * 8000000ULL / profile->rate_bps;
+        due = impair_link_free;
+    }
+    if (profile->reorder > 0 && impair_random() < profile->reorder)
+    {
+        impair_stats.reordered++;
+    }
+    else
+    {
+        long long delay = profile->latency_us;
+        if (profile->jitter_us > 0)
+            delay += (long long)((2 * impair_random() - 1) * profile->jitter_us);
+        due += delay > 0 ? delay : 0;
+        /* Jitter delays a datagram but never lets it overtake the previous one of its flow */
+        impaired_flow flow;
+        flow.fd = fd;
+        flow.port = to->sin6_port;
+        memcpy(flow.addr, &to->sin6_addr, sizeof(flow.addr));
+        unsigned long long &flow_due = impair_flow_due[flow];
+        if (due < flow_due)
+            due = flow_due;
+        flow_due = due;
+    }
+    if (due <= now)
+        return copies;
+    impair_stats.delayed++;
+    for (; copies > 0; copies--)
+    {
+        auto entry = impair_flight.emplace(due, impaired_datagram());
+        impaired_datagram &datagram = entry->second;
+        datagram.fd = fd;
+        datagram.to = *to;
+        for (i = 0; i < iovcnt; i++)
+            datagram.data.insert(datagram.data.end(), (const char *)iov[i].base, (const char *)iov[i].base + iov[i].len);
+    }
+    return 0;
+}
+
+static int
+impaired_open(const zts_sockaddr_in6 *addr, bool nonblocking)
+{
+    std::lock_guard<std::mutex> impair_lg(impair_mut);
+    const transport_t *inner = impair_inner.load(std::memory_order_relaxed);
+    zts_sockaddr_in6 local;
+    int fd;
+
+    fd = inner->open(addr, nonblocking);
+    if (fd >= 0 && inner->local_address(fd, &local) == 0)
+        impair_local[fd] = local;
+    return fd;
+}
+
+static int
+impaired_local_address(int fd, zts_sockaddr_in6 *addr)
+{
+    return impair_inner.load(std::memory_order_acquire)->local_address(fd, addr);
+}
+
+static int
+impaired_sendto(int fd, const void *buf, int len, const zts_sockaddr_in6 *to)
+{
+    std::lock_guard<std::mutex> impair_lg(impair_mut);
+    const transport_t *inner = impair_inner.load(std::memory_order_relaxed);
+    unsigned long long now = impair_now_us();
+    transport_iovec iov;
+    int copies;
+
+    iov.base = buf;
+    iov.len = len;
+    impair_release(now);
+    for (copies = impair_route(fd, &iov, 1, to, now); copies > 0; copies--)
+    {
+        if (inner->sendto(fd, buf, len, to) < 0)
+            return -1;
+    }
+    return len;
+}
+
+static int
+impaired_send_batch(int fd, const transport_datagram *batch, int count)
+{
+    std::lock_guard<std::mutex> impair_lg(impair_mut);
+    const transport_t *inner = impair_inner.load(std::memory_order_relaxed);
+    unsigned long long now = impair_now_us();
+    transport_datagram direct[2 * IMPAIR_CHUNK];
+    int i, chunk, copies, ndirect;
+
+    impair_release(now);
+    for (chunk = 0; chunk < count; chunk += IMPAIR_CHUNK)
+    {
+        ndirect = 0;
+        for (i = chunk; i < count && i < chunk + IMPAIR_CHUNK; i++)
+        {
+            for (copies = impair_route(fd, batch[i].iov, batch[i].iovcnt, &batch[i].addr, now); copies > 0; copies--)
+                direct[ndirect++] = batch[i];
+        }
+        if (ndirect > 0 && inner->send_batch(fd, direct, ndirect) < 0)
+            return chunk > 0 ? chunk : -1;
+    }
+    return count;
+}
+
+static int
+impaired_recvfrom(int fd, void *buf, int len, zts_sockaddr_in6 *from)
+{
+    return impair_inner.load(std::memory_order_acquire)->recvfrom(fd, buf, len, from);
+}
+
+static int
+impaired_recv_batch(int fd, transport_datagram *batch, int count)
+{
+    return impair_inner.load(std::memory_order_acquire)->recv_batch(fd, batch, count);
+}
+
+/* Poll the inner transport, waking up whenever a datagram in flight is due */
+static int
+impaired_poll(zts_pollfd *fds, int nfds, int timeout_ms)
+{
+    const transport_t *inner = impair_inner.load(std::memory_order_acquire);
+    unsigned long long now = impair_now_us(), deadline = now + (unsigned long long)timeout_ms * 1000ULL;
+    int ready, wait_ms;
+
+    for (;;)
+    {
+        wait_ms = timeout_ms < 0 ? -1 : (int)((deadline > now ? deadline - now + 999 : 0) / 1000);
+        {
+            std::lock_guard<std::mutex> impair_lg(impair_mut);
+            impair_release(now);
+            if (!impair_flight.empty())
+            {
+                unsigned long long due_ms = (impair_flight.begin()->first - now + 999) / 1000;
+                if (wait_ms < 0 || due_ms < (unsigned long long)wait_ms)
+                    wait_ms = (int)due_ms;
+            }
+        }
+        ready = inner->poll(fds, nfds, wait_ms);
+        now = impair_now_us();
+        if (ready != 0 || (timeout_ms >= 0 && now >= deadline))
+            return ready;
+    }
+}
+
+static int
+impaired_close(int fd)
+{
+    std::lock_guard<std::mutex> impair_lg(impair_mut);
+
+    /* The handle may be reused, its datagrams must not leave from another socket */
+    for (auto it = impair_flight.begin(); it != impair_flight.end();)
+    {
+        if (it->second.fd == fd)
+            it = impair_flight.erase(it);
+        else
+            ++it;
+    }
+    for (auto it = impair_flow_due.begin(); it != impair_flow_due.end();)
+    {
+        if (it->first.fd == fd)
+            it = impair_flow_due.erase(it);
+        else
+            ++it;
+    }
+    impair_local.erase(fd);
+    return impair_inner.load(std::memory_order_relaxed)->close(fd);
+}
+
+const transport_t transport_impaired = {
+    "impaired", impaired_open, impaired_local_address, impaired_sendto, impaired_recvfrom, impaired_recv_batch, impaired_send_batch, impaired_poll, impaired_close,
+};
+
+int
+transport_impair(const transport_t *inner, const transport_impairment *profile)
+{
+    std::lock_guard<std::mutex> impair_lg(impair_mut);
+
+    if (inner == NULL || inner == &transport_impaired || profile == NULL)
+        return -1;
+    impair_inner.store(inner, std::memory_order_release);
+    impair_profile = *profile;
+    impair_rng.seed(profile->seed);
+    impair_bad = false;
+    impair_link_free = 0;
+    impair_flight.clear();
+    impair_flow_due.clear();
+    memset(&impair_stats, 0, sizeof(impair_stats));
+    return 0;
+}
+
+void
+transport_impair_clock(void (*clock)(zts_timeval *now, void *arg), void *arg)
+{
+    std::lock_guard<std::mutex> impair_lg(impair_mut);
+
+    impair_clock = clock;
+    impair_clock_arg = arg;
+}
+
+void
+transport_impairment_get_stats(transport_impairment_stats *stats)
+{
+    std::lock_guard<std::mutex> impair_lg(impair_mut);
+
+    *stats = impair_stats;
+}
+
+const transport_t *
+transport_find(const char *name)
+{
+    const transport_t *transports[] = {&transport_zts, &transport_udp, &transport_loopback, &transport_impaired};
+
+    for (auto transport : transports)
+    {
+        if (strcmp(transport->name, name) == 0)
+            return transport;
+    }
+    return NULL;
+}
@@ -0,0 +1,141 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <ZeroTierSockets.h>
+
+/*
+ * Datagram transports.
+ *
+ * RUDP sockets and the event loops serving them do all their I/O through a
+ * transport: a table of functions with datagram socket semantics. Handles
+ * are small integers that are only meaningful to the transport that
+ * returned them, and a loop can only poll handles of its own transport.
+ *
+ * transport_zts       libzt sockets, needs a running ZeroTier node
+ * transport_udp       kernel UDP sockets
+ * transport_loopback  in-process datagram queues, delivered by port number
+ *                     whatever the destination address. Nothing leaves the
+ *                     process, so runs can be replayed exactly.
+ * transport_impaired  any of the above with the loss, delay, reordering,
+ *                     duplication and rate limit of a link, see
+ *                     transport_impair().
+ *
+ * Every function returns -1 on error.
+ */
+
+#define TRANSPORT_IOV_MAX 4 /* Segments a datagram can be gathered from */
+
+typedef struct transport_iovec {
+    const void *base;
+    int len;
+} transport_iovec;
+
+/*
+ * One datagram of a batch. On receive, <buf> and <size> are set by the
+ * caller and <len> and <addr> (the sender) by the transport. On send, the
+ * caller sets <addr> (the recipient) and the datagram is gathered from the
+ * <iovcnt> segments in <iov>.
+ */
+typedef struct transport_datagram {
+    void *buf;
+    int size;
+    int len;
+    zts_sockaddr_in6 addr;
+    transport_iovec iov[TRANSPORT_IOV_MAX];
+    int iovcnt;
+} transport_datagram;
+
+typedef struct transport {
+    const char *name;
+    /* Open a datagram socket bound to <addr> (port 0 picks a free port) */
+    int (*open)(const zts_sockaddr_in6 *addr, bool nonblocking);
+    /* The address a socket is bound to */
+    int (*local_address)(int fd, zts_sockaddr_in6 *addr);
+    int (*sendto)(int fd, const void *buf, int len, const zts_sockaddr_in6 *to);
+    /* Receive one datagram, <from> may be NULL. Returns its length. */
+    int (*recvfrom)(int fd, void *buf, int len, zts_sockaddr_in6 *from);
+    /* Receive up to <count> datagrams without blocking. Returns how many, 0 if none is waiting. */
+    int (*recv_batch)(int fd, transport_datagram *batch, int count);
+    /* Send <count> datagrams in order. Returns how many were sent before the first failure, -1 if none. */
+    int (*send_batch)(int fd, const transport_datagram *batch, int count);
+    /* Same contract as poll(2), only ZTS_POLLIN is supported */
+    int (*poll)(zts_pollfd *fds, int nfds, int timeout_ms);
+    int (*close)(int fd);
+} transport_t;
+
+extern const transport_t transport_zts;
+extern const transport_t transport_udp;
+extern const transport_t transport_loopback;
+extern const transport_t transport_impaired;
+
+/*
+ * Link impairments, applied to every datagram sent through
+ * transport_impaired. Random decisions come from a generator seeded with
+ * <seed>, so a single threaded run sees the same losses every time.
+ *
+ * Losses follow the Gilbert-Elliott model: a link in the good state drops
+ * datagrams with probability <loss>, in the bad state with <burst_loss>.
+ * Before each datagram the link turns bad with probability <burst_enter>
+ * and good again with <burst_exit>. <burst_enter> 0 gives uniform loss.
+ *
+ * A datagram that is not dropped leaves after <latency_us> plus a uniform
+ * jitter of up to <jitter_us> either way, but never before the previous
+ * datagram of its handle to the same destination: jitter alone does not
+ * reorder a flow. With probability <reorder> it skips the latency and
+ * overtakes those still in flight, which is counted in <reordered>. With probability <duplicate> it is sent twice. A
+ * <rate_bps> above 0 serializes datagrams at that many bits per second
+ * before the latency applies. With a <queue_limit> above 0, datagrams
+ * arriving while that many are in flight are dropped, as by a full router
+ * queue. A zeroed profile impairs nothing.
+ */
+typedef struct transport_impairment {
+    unsigned long long seed;
+    double loss;
+    double burst_enter;
+    double burst_exit;
+    double burst_loss;
+    int latency_us;
+    int jitter_us;
+    double reorder;
+    double duplicate;
+    long long rate_bps;
+    int queue_limit;
+} transport_impairment;
+
+/* What transport_impaired did to the datagrams sent since transport_impair() */
+typedef struct transport_impairment_stats {
+    unsigned long long datagrams;
+    unsigned long long dropped; /* by the loss model */
+    unsigned long long queue_drops; /* by the queue limit */
+    unsigned long long duplicated;
+    unsigned long long reordered;
+    unsigned long long delayed;
+} transport_impairment_stats;
+
+/*
+ * Layer transport_impaired over <inner> with the impairments of <profile>.
+ * Handles are those of <inner>. Datagrams still in flight are dropped and
+ * the generator and statistics are reset. Datagrams a socket sends to
+ * itself, like the wakeup channel of an event loop, are never impaired.
+ * There is one impaired transport per process. Until it is configured it
+ * passes datagrams to transport_zts untouched. Delayed datagrams are sent
+ * by whichever thread next polls or sends through transport_impaired, and
+ * polls wait no longer than the next one is due.
+ */
+int transport_impair(const transport_t *inner, const transport_impairment *profile);
+void transport_impairment_get_stats(transport_impairment_stats *stats);
+
+/*
+ * Take the time of transport_impaired from <clock>, called with <arg>,
+ * instead of the monotonic clock. With the clock of a simulated event loop
+ * (see event_loop_simulate()) latencies pass in simulated time and a run
+ * over transport_loopback is replayed exactly. NULL restores the monotonic
+ * clock. Only allowed while no thread sends or polls through
+ * transport_impaired.
+ */
+void transport_impair_clock(void (*clock)(zts_timeval *now, void *arg), void *arg);
+
+/* Look a transport up by name ("zts", "udp", "loopback" or "impaired"), NULL if unknown */
+const transport_t *transport_find(const char *name);
+
+#endif /* TRANSPORT_H */
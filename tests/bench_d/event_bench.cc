@@ -0,0 +1,288 @@
+/*
+ * Microbenchmarks for the event layer of Reliable-UDP_ztsified.
+ *
+ * event.cc is included directly so that the timer wheel can be driven
+ * without polling any socket (and therefore without a ZeroTier node).
+ * Build with -DRUDP_LOCK_PROFILING to get the contention of the handler
+ * mutexes printed at the end.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <time.h>
+
+#include "../../Reliable-UDP_ztsified/event.cc"
+
+namespace
+{
+
+using bench_clock = std::chrono::steady_clock;
+
+auto ns_per_op(bench_clock::time_point start, bench_clock::time_point end, size_t ops) -> double
+{
+    return std::chrono::duration<double, std::nano>(end - start).count() / (ops ? ops : 1);
+}
+
+auto noop_callback(int, void *) -> int
+{
+    return 0;
+}
+
+auto to_timeval(unsigned long tick) -> zts_timeval
+{
+    zts_timeval t;
+    t.tv_sec = tick / 1000;
+    t.tv_usec = (tick % 1000) * 1000;
+    return t;
+}
+
+/*
+ * Arm <pending> timers spread over 2 s (RUDP_TIMEOUT), cancel and reschedule
+ * <ops> of them through their handles, delete <ops> more by (callback, arg),
+ * then let the wheel expire the rest in one go.
+ */
+auto timer_bench(size_t pending, size_t ops) -> void
+{
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<unsigned long> spread(1, 2000);
+    std::vector<event_timer_t> handles(pending);
+    event_loop_t *loop = event_loop_new();
+    unsigned long start_tick = current_tick(loop);
+
+    auto t0 = bench_clock::now();
+    for(size_t i = 0; i < pending; i++)
+    {
+        handles[i] = event_timeout(loop, to_timeval(start_tick + spread(rng)), noop_callback, (void *)(uintptr_t)i, "bench");
+    }
+    auto t1 = bench_clock::now();
+
+    std::vector<size_t> order(pending);
+    for(size_t i = 0; i < pending; i++)
+    {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), rng);
+
+    auto t2 = bench_clock::now();
+    for(size_t i = 0; i < ops; i++)
+    {
+        event_timer_cancel(handles[order[i]]);
+    }
+    auto t3 = bench_clock::now();
+    for(size_t i = ops; i < 2 * ops; i++)
+    {
+        event_timer_reschedule(handles[order[i]], to_timeval(start_tick + spread(rng)));
+    }
+    auto t4 = bench_clock::now();
+    size_t deleted = 0;
+    for(size_t i = 2 * ops; i < 3 * ops; i++)
+    {
+        if(event_timeout_delete(loop, noop_callback, (void *)(uintptr_t)order[i]) == 0)
+        {
+            deleted++;
+        }
+    }
+    auto t5 = bench_clock::now();
+
+    size_t expired = 0;
+    auto t6 = bench_clock::now();
+    {
+        std::lock_guard timeout_handlers_lg(loop->timeout_handlers_mut);
+        wheel_run(&loop->timers, start_tick + 2001);
+        while(loop->timers.expired)
+        {
+            event_data *e = loop->timers.expired;
+            timer_unlink(&loop->timers, e);
+            record_free(e);
+            expired++;
+        }
+    }
+    auto t7 = bench_clock::now();
+    event_loop_free(loop);
+
+    std::cout << "timers pending=" << pending
+        << " insert=" << ns_per_op(t0, t1, pending) << "ns/op"
+        << " cancel=" << ns_per_op(t2, t3, ops) << "ns/op"
+        << " reschedule=" << ns_per_op(t3, t4, ops) << "ns/op"
+        << " delete(fn,arg)=" << ns_per_op(t4, t5, ops) << "ns/op (" << deleted << " hit)"
+        << " expire=" << ns_per_op(t6, t7, expired) << "ns/op (" << expired << " fired)"
+        << std::endl;
+}
+
+/*
+ * A retransmission storm: <count> timers due at the same tick, fired by the
+ * real eventloop (which returns once no handlers are left).
+ */
+auto timer_storm_bench(size_t count) -> void
+{
+    event_loop_t *loop = event_loop_new();
+    unsigned long due_tick = current_tick(loop) + 20;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        event_timeout(loop, to_timeval(due_tick), noop_callback, (void *)(uintptr_t)i, "bench");
+    }
+    eventloop(loop);
+    double drained_ms = (double)(current_tick(loop) - due_tick);
+    event_loop_free(loop);
+
+    std::cout << "timer storm timers=" << count << " drained " << drained_ms << "ms after the deadline" << std::endl;
+}
+
+uint64_t periodic_fired = 0;
+
+auto count_callback(int, void *) -> int
+{
+    periodic_fired++;
+    return 0;
+}
+
+auto stop_callback(int, void *arg) -> int
+{
+    eventloop_stop((event_loop_t *)arg);
+    return 0;
+}
+
+/*
+ * <count> periodic timers with a <period_ms> interval, e.g. one keepalive
+ * per session, run for <duration_ms>. Reports the loop's CPU time per fire.
+ */
+auto periodic_bench(size_t count, int period_ms, int duration_ms) -> void
+{
+    event_loop_t *loop = event_loop_new();
+    std::vector<event_timer_t> handles(count);
+
+    for(size_t i = 0; i < count; i++)
+    {
+        handles[i] = event_periodic(loop, period_ms, count_callback, NULL, "bench");
+    }
+    event_timeout(loop, to_timeval(current_tick(loop) + duration_ms), stop_callback, loop, "bench");
+    periodic_fired = 0;
+    clock_t cpu_start = clock();
+    eventloop(loop);
+    double cpu_ns = (double)(clock() - cpu_start) * 1e9 / CLOCKS_PER_SEC;
+    struct event_latency lateness;
+    event_loop_latency(loop, EVENT_LATENCY_TIMER_LATENESS, NULL, &lateness);
+    for(auto handle : handles)
+    {
+        event_timer_cancel(handle);
+    }
+    event_loop_free(loop);
+
+    std::cout << "periodic timers=" << count << " period=" << period_ms << "ms"
+        << " fired=" << periodic_fired << " (" << count * (duration_ms / period_ms) << " due)"
+        << " cpu=" << cpu_ns / (periodic_fired ? periodic_fired : 1) << "ns/fire"
+        << " lateness p50=" << lateness.p50_ns / 1000 << "us p99=" << lateness.p99_ns / 1000 << "us" << std::endl;
+}
+
+/*
+ * <count> retransmission timers armed at random points of a 2 s interval,
+ * fired by the real eventloop with a timer slack of <slack_ms>. Reports the
+ * number of loop wakeups and the worst lateness the slack added.
+ */
+auto slack_bench(size_t count, int slack_ms) -> void
+{
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<unsigned long> spread(1, 2000);
+    event_loop_t *loop = event_loop_new();
+    unsigned long start_tick = current_tick(loop);
+
+    event_loop_set_timer_slack(loop, slack_ms);
+    for(size_t i = 0; i < count; i++)
+    {
+        event_timeout(loop, to_timeval(start_tick + spread(rng)), noop_callback, (void *)(uintptr_t)i, "bench");
+    }
+    clock_t cpu_start = clock();
+    eventloop(loop);
+    double cpu_ms = (double)(clock() - cpu_start) * 1e3 / CLOCKS_PER_SEC;
+    struct event_latency wakeups, lateness;
+    event_loop_latency(loop, EVENT_LATENCY_POLL_WAIT, NULL, &wakeups);
+    event_loop_latency(loop, EVENT_LATENCY_TIMER_LATENESS, NULL, &lateness);
+    event_loop_free(loop);
+
+    std::cout << "slack timers=" << count << " slack=" << slack_ms << "ms"
+        << " wakeups=" << wakeups.count << " cpu=" << cpu_ms << "ms"
+        << " lateness p50=" << lateness.p50_ns / 1000 << "us max=" << lateness.max_ns / 1000 << "us" << std::endl;
+}
+
+struct sim_session
+{
+    event_timer_t timer;
+    uint64_t id;
+    uint64_t *trace;
+};
+
+/* Fold the virtual time and the session of every fire into a trace hash */
+auto sim_callback(int, void *arg) -> int
+{
+    sim_session *session = (sim_session *)arg;
+    event_loop_t *loop = event_loop_current();
+    zts_timeval now;
+    event_loop_time(loop, &now);
+    *session->trace = (*session->trace ^ ((uint64_t)now.tv_sec * 1000000 + now.tv_usec) ^ session->id) * 1099511628211ULL;
+    periodic_fired++;
+    now.tv_sec += 2;
+    event_timer_reschedule(session->timer, now);
+    return 0;
+}
+
+/*
+ * <sessions> retransmission timers re-armed every 2 s (RUDP_TIMEOUT) for
+ * <hours> of virtual time on a simulated loop. Reports the wall time the
+ * simulation took and a hash of the order and times of all fires, which is
+ * the same on every run.
+ */
+auto simulation_bench(size_t sessions, int hours) -> void
+{
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<unsigned long> spread(1, 2000);
+    event_loop_t *loop = event_loop_new();
+    std::vector<sim_session> session(sessions);
+    uint64_t trace = 1469598103934665603ULL;
+    zts_timeval start;
+    start.tv_sec = 1000000;
+    start.tv_usec = 0;
+
+    event_loop_simulate(loop, start);
+    for(size_t i = 0; i < sessions; i++)
+    {
+        session[i].id = i;
+        session[i].trace = &trace;
+        session[i].timer = event_timeout(loop, to_timeval(start.tv_sec * 1000UL + spread(rng)), sim_callback, &session[i], "bench");
+    }
+    event_timeout(loop, to_timeval(start.tv_sec * 1000UL + hours * 3600000UL), stop_callback, loop, "bench");
+    periodic_fired = 0;
+    auto t0 = bench_clock::now();
+    eventloop(loop);
+    auto t1 = bench_clock::now();
+    for(auto &s : session)
+    {
+        event_timer_cancel(s.timer);
+    }
+    event_loop_free(loop);
+
+    std::cout << "simulation sessions=" << sessions << " virtual=" << hours << "h"
+        << " fired=" << periodic_fired << " wall=" << std::chrono::duration<double, std::milli>(t1 - t0).count() << "ms"
+        << " trace=" << std::hex << trace << std::dec << std::endl;
+}
+
+} // namespace
+
+auto main() -> int
+{
+    timer_bench(10000, 1000);
+    timer_bench(100000, 1000);
+    timer_storm_bench(1000);
+    periodic_bench(10000, 10, 1000);
+    slack_bench(10000, 0);
+    slack_bench(10000, 20);
+    simulation_bench(100, 1);
+    simulation_bench(100, 1);
+    lock_profile_dump(std::cout);
+
+    return 0;
+}
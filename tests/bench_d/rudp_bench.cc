@@ -0,0 +1,467 @@
+/*
+ * Benchmarks for the RUDP protocol engine in Reliable-UDP_ztsified.
+ * Usage: ./rudp_bench [rounds] [loops] [pairs] [messages per pair] [transport] [link] [window] [ack every]
+ *
+ * The sockets are bound on the IPv6 loopback address. With the default "zts"
+ * transport the zts_* calls have to be served by a running ZeroTier stack (or
+ * a stand-in providing the same API); "udp" uses kernel sockets and
+ * "loopback" keeps every datagram inside the process. The library logs every packet to stdout, the results are printed to
+ * stderr, so run it as ./rudp_bench > /dev/null.
+ *
+ * A link profile ("lan", "wan" or "lossy") runs the transport under the
+ * impairments of such a link, see link_profiles; "none" leaves it as is.
+ * The throughput senders use a window of [window] packets, RUDP_WINDOW by
+ * default, and the receivers ACK every [ack every] packets or after
+ * RUDP_ACK_DELAY, RUDP_ACK_EVERY packets by default.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include <string.h>
+
+#include "../../Reliable-UDP_ztsified/event.h"
+#include "../../Reliable-UDP_ztsified/lock_profiler.h"
+#include "../../Reliable-UDP_ztsified/rudp_api.h"
+#include "../../Reliable-UDP_ztsified/transport.h"
+
+/*
+ * Every heap allocation of the process is counted, to see what the engine
+ * allocates per message once it is warmed up.
+ */
+std::atomic<uint64_t> heap_allocations(0);
+
+auto operator new(size_t size) -> void *
+{
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    void *block = malloc(size ? size : 1);
+    if(block == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+auto operator new(size_t size, const std::nothrow_t &) noexcept -> void *
+{
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+    return malloc(size ? size : 1);
+}
+
+auto operator delete(void *block) noexcept -> void
+{
+    free(block);
+}
+
+auto operator delete(void *block, size_t) noexcept -> void
+{
+    free(block);
+}
+
+namespace
+{
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr int ping_port = 9100;
+constexpr int pong_port = 9101;
+constexpr int echo_port = 9102;
+constexpr int ping_return_port = 9103;
+constexpr int sender_base_port = 9200;
+constexpr int receiver_base_port = 9400;
+
+/* Wait this long for a message before reporting it lost, above the longest retransmission sequence */
+constexpr auto message_timeout = std::chrono::seconds(30);
+
+/*
+ * Impairments of the links the engine has to cope with, all of them with
+ * a fixed seed so that runs are comparable.
+ */
+struct link_profile
+{
+    const char *name;
+    transport_impairment impairment;
+};
+
+const link_profile link_profiles[] = {
+    /* seed, loss, burst enter/exit/loss, latency, jitter, reorder, duplicate, rate, queue */
+    {"lan", {1, 0, 0, 0, 0, 250, 50, 0, 0, 1000000000, 1000}},
+    {"wan", {1, 0.001, 0, 0, 0, 20000, 2000, 0.001, 0, 100000000, 1000}},
+    /* A relayed path: loss in bursts, reordering and duplicates */
+    {"lossy", {1, 0.005, 0.01, 0.3, 0.5, 40000, 10000, 0.01, 0.005, 20000000, 500}},
+};
+
+auto loopback_addr(int port) -> zts_sockaddr_in6
+{
+    zts_sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = ZTS_AF_INET6;
+    addr.sin6_port = zts_htons(port);
+    zts_inet_pton(ZTS_AF_INET6, "::1", &addr.sin6_addr);
+
+    return addr;
+}
+
+/*
+ * The selected transport with the bytes it sends counted, to see what the
+ * wire format costs per message.
+ */
+const transport_t *counted_transport;
+transport_t counting_transport;
+std::atomic<uint64_t> wire_bytes(0);
+std::atomic<uint64_t> wire_datagrams(0);
+
+auto counting_sendto(int fd, const void *buf, int len, const zts_sockaddr_in6 *to) -> int
+{
+    int sent = counted_transport->sendto(fd, buf, len, to);
+    if(sent >= 0)
+    {
+        wire_bytes += len;
+        wire_datagrams++;
+    }
+    return sent;
+}
+
+auto counting_send_batch(int fd, const transport_datagram *batch, int count) -> int
+{
+    int sent = counted_transport->send_batch(fd, batch, count);
+    for(int i = 0; i < sent; i++)
+    {
+        for(int j = 0; j < batch[i].iovcnt; j++)
+        {
+            wire_bytes += batch[i].iov[j].len;
+        }
+        wire_datagrams++;
+    }
+    return sent;
+}
+
+auto wire_reset() -> void
+{
+    wire_bytes = 0;
+    wire_datagrams = 0;
+}
+
+/*
+ * The echo side hands received messages to an application thread which sends
+ * them back, the way a program using RUDP from its own threads would.
+ */
+std::mutex echo_mut;
+std::condition_variable echo_cv;
+std::queue<std::pair<zts_sockaddr_in6, std::vector<char>>> echo_queue;
+
+std::mutex pong_mut;
+std::condition_variable pong_cv;
+uint64_t pongs_received = 0;
+
+auto echo_recv(rudp_socket_t, zts_sockaddr_in6 *from, char *data, int len) -> int
+{
+    std::lock_guard echo_lg(echo_mut);
+    echo_queue.emplace(*from, std::vector<char>(data, data + len));
+    echo_cv.notify_one();
+
+    return 0;
+}
+
+auto ping_recv(rudp_socket_t, zts_sockaddr_in6 *, char *, int) -> int
+{
+    std::lock_guard pong_lg(pong_mut);
+    pongs_received++;
+    pong_cv.notify_one();
+
+    return 0;
+}
+
+auto ignore_event(rudp_socket_t, rudp_event_t, zts_sockaddr_in6 *) -> int
+{
+    return 0;
+}
+
+auto percentile(std::vector<double> samples, double p) -> double
+{
+    std::sort(samples.begin(), samples.end());
+
+    return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+}
+
+/*
+ * Round trip latency of a small message between RUDP sockets.
+ * Each direction uses its own pair of sockets, so that every session only
+ * carries data one way.
+ */
+auto pingpong_bench(int rounds) -> void
+{
+    rudp_socket_t ping = rudp_socket(ping_port);
+    rudp_socket_t pong = rudp_socket(pong_port);
+    rudp_socket_t echo = rudp_socket(echo_port);
+    rudp_socket_t ping_return = rudp_socket(ping_return_port);
+    for(auto socket : {ping, pong, echo, ping_return})
+    {
+        if(socket == (rudp_socket_t)-1)
+        {
+            std::cerr << "pingpong: couldn't create sockets" << std::endl;
+            return;
+        }
+        rudp_event_handler(socket, ignore_event);
+    }
+    rudp_recvfrom_handler(pong, echo_recv);
+    rudp_recvfrom_handler(ping_return, ping_recv);
+
+    std::thread loop_thread([]() { eventloop(event_loop_default()); });
+    loop_thread.detach();
+
+    std::thread echo_thread([echo]() {
+        zts_sockaddr_in6 return_addr = loopback_addr(ping_return_port);
+        for(;;)
+        {
+            std::unique_lock echo_ul(echo_mut);
+            echo_cv.wait(echo_ul, []() { return !echo_queue.empty(); });
+            auto msg = std::move(echo_queue.front());
+            echo_queue.pop();
+            echo_ul.unlock();
+            rudp_sendto(echo, msg.second.data(), msg.second.size(), &return_addr);
+        }
+    });
+    echo_thread.detach();
+
+    zts_sockaddr_in6 pong_addr = loopback_addr(pong_port);
+    char msg[32] = "ping";
+    std::vector<double> rtts;
+    wire_reset();
+    for(int i = 0; i < rounds; i++)
+    {
+        auto start = bench_clock::now();
+        rudp_sendto(ping, msg, sizeof(msg), &pong_addr);
+        std::unique_lock pong_ul(pong_mut);
+        if(!pong_cv.wait_for(pong_ul, message_timeout, [i]() { return pongs_received > (uint64_t)i; }))
+        {
+            std::cerr << "pingpong: round " << i << " lost, giving up" << std::endl;
+            rounds = i;
+            break;
+        }
+        rtts.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - start).count());
+    }
+
+    /* The first round includes both session handshakes */
+    if(rounds == 0)
+    {
+        return;
+    }
+    std::cerr << "pingpong rounds=" << rounds
+        << " first=" << rtts[0] << "us"
+        << " p50=" << percentile(rtts, 0.5) << "us"
+        << " p99=" << percentile(rtts, 0.99) << "us"
+        << " max=" << percentile(rtts, 1.0) << "us"
+        << " wire=" << wire_bytes / rounds << " bytes/round"
+        << " in " << (double)wire_datagrams / rounds << " datagrams" << std::endl;
+}
+
+/*
+ * Many sockets sending at once, served by an engine of <loops> event loops.
+ */
+std::mutex delivered_mut;
+std::condition_variable delivered_cv;
+uint64_t messages_delivered = 0;
+
+auto count_recv(rudp_socket_t, zts_sockaddr_in6 *, char *, int) -> int
+{
+    std::lock_guard delivered_lg(delivered_mut);
+    messages_delivered++;
+    delivered_cv.notify_one();
+
+    return 0;
+}
+
+auto throughput_bench(int loops, int pairs, int messages, int window, int ack_every) -> void
+{
+    if(rudp_engine_start(loops) < 0)
+    {
+        std::cerr << "throughput: couldn't start the engine" << std::endl;
+        return;
+    }
+    std::vector<std::pair<rudp_socket_t, zts_sockaddr_in6>> senders;
+    for(int i = 0; i < pairs; i++)
+    {
+        rudp_socket_t sender = rudp_socket(sender_base_port + i);
+        rudp_socket_t receiver = rudp_socket(receiver_base_port + i);
+        if(sender == (rudp_socket_t)-1 || receiver == (rudp_socket_t)-1)
+        {
+            std::cerr << "throughput: couldn't create sockets" << std::endl;
+            return;
+        }
+        rudp_event_handler(sender, ignore_event);
+        rudp_event_handler(receiver, ignore_event);
+        rudp_window(sender, window);
+        rudp_delayed_ack(receiver, ack_every, RUDP_ACK_DELAY);
+        rudp_recvfrom_handler(receiver, count_recv);
+        senders.emplace_back(sender, loopback_addr(receiver_base_port + i));
+    }
+
+    /* Sent from this thread, the calls are posted to the senders' loops */
+    char payload[RUDP_MAXPKTSIZE];
+    memset(payload, 'x', sizeof(payload));
+    wire_reset();
+    uint64_t heap_start = heap_allocations.load(std::memory_order_relaxed);
+    auto start = bench_clock::now();
+    for(int i = 0; i < messages; i++)
+    {
+        for(auto &sender : senders)
+        {
+            rudp_sendto(sender.first, payload, sizeof(payload), &sender.second);
+        }
+    }
+    uint64_t total = (uint64_t)pairs * messages;
+    std::unique_lock delivered_ul(delivered_mut);
+    /* Stops once no message got through for message_timeout */
+    uint64_t delivered_before = 0;
+    while(!delivered_cv.wait_for(delivered_ul, message_timeout, [total]() { return messages_delivered >= total; }))
+    {
+        if(messages_delivered == delivered_before)
+        {
+            std::cerr << "throughput: only " << messages_delivered << " of " << total << " messages delivered" << std::endl;
+            total = messages_delivered;
+            break;
+        }
+        delivered_before = messages_delivered;
+    }
+    if(total == 0)
+    {
+        return;
+    }
+    double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+    uint64_t heap = heap_allocations.load(std::memory_order_relaxed) - heap_start;
+
+    std::cerr << "throughput loops=" << loops << " pairs=" << pairs << " window=" << window << " ack=" << ack_every << " messages=" << total
+        << " " << total / seconds << " msg/s"
+        << " " << total * RUDP_MAXPKTSIZE / seconds / 1e6 << " MB/s"
+        << " wire=" << wire_bytes / total << " bytes/msg in " << (double)wire_datagrams / total << " datagrams"
+        << " heap=" << (double)heap / total << " allocs/msg" << std::endl;
+
+    std::vector<event_loop_t *> engine;
+    for(auto &sender : senders)
+    {
+        event_loop_t *loop = rudp_socket_loop(sender.first);
+        if(std::find(engine.begin(), engine.end(), loop) == engine.end())
+        {
+            engine.push_back(loop);
+        }
+    }
+    for(size_t i = 0; i < engine.size(); i++)
+    {
+        struct event_alloc_stats alloc;
+        event_loop_alloc_stats(engine[i], &alloc);
+        std::cerr << "loop " << i << " events=" << alloc.records_allocated
+            << " peak=" << alloc.records_in_use_max
+            << " slab mallocs=" << alloc.slab_mallocs << std::endl;
+        std::cerr << "loop " << i << " latency:" << std::endl;
+        event_loop_latency_dump(engine[i], stderr);
+    }
+}
+
+/*
+ * Payload bytes the engine copied per byte sent and per byte delivered, over
+ * both benchmarks.
+ */
+auto copy_stats_dump() -> void
+{
+    struct rudp_copy_stats stats;
+    if(rudp_copy_stats(&stats) < 0)
+    {
+        std::cerr << "copy stats disabled, build with -DRUDP_COPY_STATS" << std::endl;
+        return;
+    }
+    std::cerr << "copies send=" << (double)stats.send_copied / stats.send_accepted << " bytes/byte"
+        << " receive=" << (double)stats.receive_copied / stats.receive_delivered << " bytes/byte"
+        << " (" << stats.send_accepted << " bytes sent, " << stats.receive_delivered << " delivered)" << std::endl;
+}
+
+/*
+ * Slab allocations and high-water marks of the engine's object pools, over
+ * both benchmarks.
+ */
+auto pool_stats_dump() -> void
+{
+    struct rudp_pool_stats stats[32];
+    int count = rudp_pool_stats(stats, 32);
+    for(int i = 0; i < count && i < 32; i++)
+    {
+        std::cerr << "pool " << stats[i].name << " slabs=" << stats[i].slab_mallocs
+            << " allocated=" << stats[i].allocated << " in_use=" << stats[i].in_use
+            << " in_use_max=" << stats[i].in_use_max << std::endl;
+    }
+}
+
+/* What the link did to the datagrams of both benchmarks */
+auto impairment_stats_dump() -> void
+{
+    transport_impairment_stats stats;
+    transport_impairment_get_stats(&stats);
+    std::cerr << "link datagrams=" << stats.datagrams << " dropped=" << stats.dropped
+        << " queue_drops=" << stats.queue_drops << " duplicated=" << stats.duplicated
+        << " reordered=" << stats.reordered << " delayed=" << stats.delayed << std::endl;
+}
+
+} // namespace
+
+auto main(int argc, char **argv) -> int
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 200;
+    int loops = argc > 2 ? atoi(argv[2]) : 4;
+    int pairs = argc > 3 ? atoi(argv[3]) : 16;
+    int messages = argc > 4 ? atoi(argv[4]) : 500;
+    const char *transport_name = argc > 5 ? argv[5] : "zts";
+    const char *link_name = argc > 6 && strcmp(argv[6], "none") != 0 ? argv[6] : NULL;
+    int window = argc > 7 ? atoi(argv[7]) : RUDP_WINDOW;
+    int ack_every = argc > 8 ? atoi(argv[8]) : RUDP_ACK_EVERY;
+
+    const transport_t *transport = transport_find(transport_name);
+    if(transport == NULL)
+    {
+        std::cerr << "unknown transport " << transport_name << std::endl;
+        return 1;
+    }
+    if(link_name != NULL)
+    {
+        auto profile = std::find_if(std::begin(link_profiles), std::end(link_profiles),
+            [link_name](const link_profile &profile) { return strcmp(profile.name, link_name) == 0; });
+        if(profile == std::end(link_profiles) || transport_impair(transport, &profile->impairment) < 0)
+        {
+            std::cerr << "unknown link " << link_name << std::endl;
+            return 1;
+        }
+        transport = &transport_impaired;
+        std::cerr << "link " << link_name << std::endl;
+    }
+    counted_transport = transport;
+    counting_transport = *transport;
+    counting_transport.sendto = counting_sendto;
+    counting_transport.send_batch = counting_send_batch;
+    if(rudp_set_transport(&counting_transport) < 0)
+    {
+        std::cerr << "couldn't select transport " << transport_name << std::endl;
+        return 1;
+    }
+    std::cerr << "transport " << transport->name << std::endl;
+
+    pingpong_bench(rounds);
+    throughput_bench(loops, pairs, messages, window, ack_every);
+    lock_profile_dump(std::cerr);
+    copy_stats_dump();
+    pool_stats_dump();
+    if(link_name != NULL)
+    {
+        impairment_stats_dump();
+    }
+
+    /* The event loop keeps running as long as sockets are registered */
+    std::quick_exit(0);
+}
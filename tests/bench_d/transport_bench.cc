@@ -0,0 +1,190 @@
+/*
+ * Packets-per-second benchmark of the transports' receive and send paths.
+ * Usage: ./transport_bench [datagrams] [transport]
+ *
+ * Full size RUDP datagrams are written to a socket in bursts, and the
+ * receiver polls the socket and reads either one datagram per wakeup, as
+ * receive_callback() used to, or everything waiting up to RUDP_RECV_BATCH
+ * datagrams per call. On the send side, a burst is handed to the transport
+ * either one sendto() at a time or as one batch, the way a socket's queue is
+ * flushed at the end of a loop iteration.
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <string.h>
+
+#include "../../Reliable-UDP_ztsified/transport.h"
+
+namespace
+{
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr int datagram_size = 1008; /* RUDP header and RUDP_MAXPKTSIZE bytes */
+constexpr int batch_size = 32; /* RUDP_RECV_BATCH and RUDP_SEND_BATCH */
+
+auto loopback_addr(int port) -> zts_sockaddr_in6
+{
+    zts_sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = ZTS_AF_INET6;
+    addr.sin6_port = zts_htons(port);
+    zts_inet_pton(ZTS_AF_INET6, "::1", &addr.sin6_addr);
+
+    return addr;
+}
+
+/*
+ * Receive <datagrams> datagrams in bursts of <burst>: each burst is written
+ * to the socket first and then drained through poll, so the socket buffer
+ * never overflows and only the receive path is timed.
+ */
+auto receive_bench(const transport_t *transport, int datagrams, int burst, bool batched) -> void
+{
+    zts_sockaddr_in6 any = loopback_addr(0);
+    int receiver = transport->open(&any, false);
+    int sender = transport->open(&any, false);
+    zts_sockaddr_in6 to;
+    if(receiver < 0 || sender < 0 || transport->local_address(receiver, &to) < 0)
+    {
+        std::cerr << "receive: couldn't open " << transport->name << " sockets" << std::endl;
+        return;
+    }
+
+    char datagram[datagram_size];
+    memset(datagram, 'x', sizeof(datagram));
+    std::vector<std::vector<char>> buffers(batch_size, std::vector<char>(datagram_size));
+    std::vector<transport_datagram> batch(batch_size);
+    for(int i = 0; i < batch_size; i++)
+    {
+        batch[i].buf = buffers[i].data();
+        batch[i].size = datagram_size;
+    }
+    zts_pollfd pollfd;
+    pollfd.fd = receiver;
+    pollfd.events = ZTS_POLLIN;
+    uint64_t received = 0, wakeups = 0;
+    bench_clock::duration elapsed(0);
+    for(int sent = 0; sent < datagrams; sent += burst)
+    {
+        for(int i = 0; i < burst; i++)
+        {
+            transport->sendto(sender, datagram, sizeof(datagram), &to);
+        }
+        auto start = bench_clock::now();
+        for(;;)
+        {
+            pollfd.revents = 0;
+            if(transport->poll(&pollfd, 1, 0) <= 0)
+            {
+                break;
+            }
+            wakeups++;
+            if(batched)
+            {
+                received += transport->recv_batch(receiver, batch.data(), batch_size);
+            }
+            else if(transport->recvfrom(receiver, buffers[0].data(), datagram_size, &batch[0].addr) >= 0)
+            {
+                received++;
+            }
+        }
+        elapsed += bench_clock::now() - start;
+    }
+    transport->close(receiver);
+    transport->close(sender);
+    double seconds = std::chrono::duration<double>(elapsed).count();
+
+    std::cerr << "receive transport=" << transport->name << (batched ? " batched" : " single")
+        << " burst=" << burst << " received=" << received << " wakeups=" << wakeups
+        << " " << received / seconds << " pkt/s" << std::endl;
+}
+
+/*
+ * Send <datagrams> datagrams in bursts of batch_size, draining the receiver
+ * after each burst untimed so its buffer never overflows.
+ */
+auto send_bench(const transport_t *transport, int datagrams, bool batched) -> void
+{
+    zts_sockaddr_in6 any = loopback_addr(0);
+    int receiver = transport->open(&any, true);
+    int sender = transport->open(&any, false);
+    zts_sockaddr_in6 to;
+    if(receiver < 0 || sender < 0 || transport->local_address(receiver, &to) < 0)
+    {
+        std::cerr << "send: couldn't open " << transport->name << " sockets" << std::endl;
+        return;
+    }
+
+    std::vector<std::vector<char>> buffers(batch_size, std::vector<char>(datagram_size, 'x'));
+    std::vector<transport_datagram> batch(batch_size);
+    for(int i = 0; i < batch_size; i++)
+    {
+        batch[i].buf = buffers[i].data();
+        batch[i].size = datagram_size;
+        batch[i].iov[0].base = buffers[i].data();
+        batch[i].iov[0].len = datagram_size;
+        batch[i].iovcnt = 1;
+        batch[i].addr = to;
+    }
+    char drain[datagram_size];
+    uint64_t sent = 0, calls = 0;
+    bench_clock::duration elapsed(0);
+    while(sent < (uint64_t)datagrams)
+    {
+        auto start = bench_clock::now();
+        if(batched)
+        {
+            int n = transport->send_batch(sender, batch.data(), batch_size);
+            sent += n > 0 ? n : 0;
+            calls++;
+        }
+        else
+        {
+            for(int i = 0; i < batch_size; i++)
+            {
+                if(transport->sendto(sender, batch[i].buf, datagram_size, &to) >= 0)
+                {
+                    sent++;
+                }
+                calls++;
+            }
+        }
+        elapsed += bench_clock::now() - start;
+        while(transport->recvfrom(receiver, drain, sizeof(drain), NULL) >= 0)
+        {
+        }
+    }
+    transport->close(receiver);
+    transport->close(sender);
+    double seconds = std::chrono::duration<double>(elapsed).count();
+
+    std::cerr << "send transport=" << transport->name << (batched ? " batched" : " single")
+        << " burst=" << batch_size << " sent=" << sent << " calls=" << calls
+        << " " << sent / seconds << " pkt/s" << std::endl;
+}
+
+} // namespace
+
+auto main(int argc, char **argv) -> int
+{
+    int datagrams = argc > 1 ? atoi(argv[1]) : 200000;
+    const char *transport_name = argc > 2 ? argv[2] : "udp";
+
+    const transport_t *transport = transport_find(transport_name);
+    if(transport == NULL)
+    {
+        std::cerr << "unknown transport " << transport_name << std::endl;
+        return 1;
+    }
+    receive_bench(transport, datagrams, 64, false);
+    receive_bench(transport, datagrams, 64, true);
+    send_bench(transport, datagrams, false);
+    send_bench(transport, datagrams, true);
+
+    return 0;
+}
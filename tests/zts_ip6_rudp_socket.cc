@@ -7,14 +7,24 @@
 namespace standby_network
 {
 
-static std::packaged_task<void()> empty_task([](){});
-
 std::mutex ZTS_IP6_RUDP_Socket::data_queue_mut;
 std::map<rudp_socket_t, std::map<std::string, std::queue<ByteArray>>> ZTS_IP6_RUDP_Socket::data_queue;
-std::future<void> ZTS_IP6_RUDP_Socket::is_eventloop_done = empty_task.get_future();
-std::thread ZTS_IP6_RUDP_Socket::eventloop_thread = std::thread(std::move(empty_task));
+std::once_flag ZTS_IP6_RUDP_Socket::eventloop_started;
+ZTS_IP6_RUDP_Socket::EventloopThread ZTS_IP6_RUDP_Socket::eventloop_thread;
 std::mutex ZTS_IP6_RUDP_Socket::socket_count_mut;
+std::condition_variable ZTS_IP6_RUDP_Socket::sockets_closed_cv;
 uint32_t ZTS_IP6_RUDP_Socket::socket_count = 0;
+uint32_t ZTS_IP6_RUDP_Socket::unclosed_count = 0;
+std::set<rudp_socket_t> ZTS_IP6_RUDP_Socket::closing;
+
+ZTS_IP6_RUDP_Socket::EventloopThread::~EventloopThread()
+{
+    if(thread.joinable())
+    {
+        eventloop_stop(event_loop_default());
+        thread.join();
+    }
+}
 
 auto try_addr_to_str(const zts_sockaddr_in6 &addr) -> std::string
 {
@@ -39,31 +49,21 @@ ZTS_IP6_RUDP_Socket::ZTS_IP6_RUDP_Socket(uint16_t port) :
     rudp_recvfrom_handler(socket, recv_callback);
     rudp_event_handler(socket, event_callback);
 
-    std::lock_guard socket_count_lg(socket_count_mut);
+    std::unique_lock socket_count_ul(socket_count_mut);
     socket_count++;
+    unclosed_count++;
+    socket_count_ul.unlock();
 
     std::unique_lock data_q_ul(data_queue_mut);
     data_queue[socket] = std::map<std::string, std::queue<ByteArray>>();
     data_q_ul.unlock();
 
     /*
-    Now here comes the problematic part. So we have an eventloop() in the underlying library which works something like this:
-    it runs until there are subscribed event handlers on the underlying file descriptors (unix sockets) or timer-event-handlers.
-    That means if only one sockets existed and it has been destructed, the eventloop stops. So we have to restart it.
-    We do this by using std::future and std::packaged_task because the eventloop has to be run on a separate thread for our
-    usecase. Why? The underlying RUDP library is event based and written in C. We want our library to be consistent with UDP thus we need non-blocking
-    on demand API and RAII. Maybe it would have been faster to implement it in an eventbased fashion without doing any C++ RAII wrapping,
-    but than again, lua bindings for this should be done differently then for the UDP and that way we created even more inconsistency.
-    My goal was to eliminate that.
+    The underlying RUDP library is event based and written in C, but we want an API consistent with UDP: non-blocking,
+    on demand and RAII. So the default event loop runs on a thread of its own. eventloop_run() keeps serving the loop
+    while no socket is open, so the thread is started with the first socket and lives until the program exits.
     */
-    auto status = is_eventloop_done.wait_for(std::chrono::milliseconds(0));
-    if(status == std::future_status::ready)
-    {
-        std::packaged_task<void()> task([]() { eventloop(); return; });
-        is_eventloop_done = task.get_future();
-        eventloop_thread.join();
-        eventloop_thread = std::thread(std::move(task));
-    }
+    std::call_once(eventloop_started, []() { eventloop_thread.thread = std::thread([]() { eventloop_run(event_loop_default()); }); });
 }
 
 ZTS_IP6_RUDP_Socket::ZTS_IP6_RUDP_Socket(ZTS_IP6_RUDP_Socket &&move) :
@@ -77,18 +77,24 @@ ZTS_IP6_RUDP_Socket::ZTS_IP6_RUDP_Socket(ZTS_IP6_RUDP_Socket &&move) :
 ZTS_IP6_RUDP_Socket::~ZTS_IP6_RUDP_Socket()
 {
     /*
-    Here we request a close on the underlying socket and wait for
-    the eventloop to finish if there's no other sockets left open,
-    just to make sure that the application is not terminating sooner
-    then the eventloop
+    Here we request a close on the underlying socket and, if there's no
+    other sockets left open, wait for every closed socket to finish its
+    pending transfers, just to make sure that the application is not
+    terminating sooner than the sockets. A moved-from
+    object has no socket of its own to close or count.
     */
+    if(socket == nullptr)
+    {
+        return;
+    }
 
-    std::lock_guard socket_count_lg(socket_count_mut);
+    std::unique_lock socket_count_ul(socket_count_mut);
+    closing.insert(socket);
     rudp_close(socket);
     socket_count--;
     if(!socket_count)
     {
-        eventloop_thread.join();
+        sockets_closed_cv.wait(socket_count_ul, []() { return unclosed_count == 0; });
     }
 }
 
@@ -171,13 +177,16 @@ auto ZTS_IP6_RUDP_Socket::recv_callback(rudp_socket_t socket, zts_sockaddr_in6 *
 
 auto ZTS_IP6_RUDP_Socket::event_callback(rudp_socket_t socket, rudp_event_t event_type, zts_sockaddr_in6 *to) -> int
 {
-    if(event_type == RUDP_EVENT_TIMEOUT)
-    {
-        // dunno
-    }
-    else
+    /*
+    A session that gave up with a timeout never gets to RUDP_EVENT_CLOSED, so
+    for a socket being closed that counts as closed too. Each socket is counted
+    once, other timeouts are ignored for now.
+    */
+    std::lock_guard socket_count_lg(socket_count_mut);
+    if(closing.erase(socket) > 0)
     {
-        // dunno
+        unclosed_count--;
+        sockets_closed_cv.notify_all();
     }
 
     return 0;
@@ -1,11 +1,13 @@
 #ifndef _ZTS_IP6_RUDP_SOCKET_H_
 #define _ZTS_IP6_RUDP_SOCKET_H_
 
+#include <condition_variable>
 #include <functional>
-#include <future>
 #include <map>
 #include <mutex>
+#include <optional>
 #include <queue>
+#include <set>
 #include <thread>
 
 #include <stdint.h>
@@ -45,8 +47,8 @@ public:
     ZTS_IP6_RUDP_Socket(const ZTS_IP6_RUDP_Socket &copy) = delete;
     ZTS_IP6_RUDP_Socket(ZTS_IP6_RUDP_Socket &&move);
     /**
-     * @brief if there are no other sockets open when this is called, it blocks until this socket is closed properly
-     * This means if there is any pending operation on this socket, that operation has to finish first.
+     * @brief if there are no other sockets open when this is called, it blocks until every socket is closed properly
+     * This means if there is any pending operation on the sockets, those operations have to finish first.
      */
     ~ZTS_IP6_RUDP_Socket();
 
@@ -91,26 +93,44 @@ private:
     static auto recv_callback(rudp_socket_t socket, zts_sockaddr_in6 *from, char *data, int len) -> int;
     /**
      * @brief this is used as the calbback function for the timeout and close events of the underlying RUDP library
-     * It does nothing for now. Didn't have the time to get there.
+     * Close events are counted for the destructor. A socket giving up on a peer after its close was requested never
+     * gets a close event, so its timeout is counted instead; other timeouts are ignored for now.
      */
     static auto event_callback(rudp_socket_t socket, rudp_event_t event_type, zts_sockaddr_in6 *to) -> int;
 
 private:
     static std::mutex data_queue_mut;
     static std::map<rudp_socket_t, std::map<std::string, std::queue<ByteArray>>> data_queue;
-    static std::future<void> is_eventloop_done;
-    static std::thread eventloop_thread;
 
 private:
     /**
-     * This counter makes sure to join the eventloop thread
+     * @brief the thread serving the default event loop
+     * It's started by the first socket and runs until the program exits,
+     * then the loop is stopped and the thread is joined.
+     */
+    struct EventloopThread
+    {
+        ~EventloopThread();
+        std::thread thread;
+    };
+
+    static std::once_flag eventloop_started;
+    static EventloopThread eventloop_thread;
+
+private:
+    /**
+     * These counters make sure the sockets are closed properly
      * before application exit like so:
-     * Every (non-move, non-copy) constructor call increases it
-     * Every destructor call decreases it
-     * If the decreased count == 0, then we join the thread
+     * Every (non-move, non-copy) constructor call increases both
+     * Every destructor call of a socket that was not moved from decreases socket_count
+     * Every RUDP_EVENT_CLOSED, or RUDP_EVENT_TIMEOUT after the close, of a closing socket decreases unclosed_count
+     * If the decreased socket_count == 0, then we wait for unclosed_count == 0
      */
     static std::mutex socket_count_mut;
+    static std::condition_variable sockets_closed_cv;
     static uint32_t socket_count;
+    static uint32_t unclosed_count;
+    static std::set<rudp_socket_t> closing; /* closed by their destructor, not counted as closed yet */
 };
 
 } // namespace standby_network